@@ -0,0 +1,1080 @@
+/*
+ * Copyright (C) 2013-2015 Willy Tarreau <w@1wt.eu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "slz.h"
+
+/* Log2 of the size of the main decoding tables. Codes longer than this are
+ * decoded through a second level table. The code lengths code never exceeds
+ * 7 bits so it only has a main table.
+ */
+#define LIT_BITS   11
+#define DIST_BITS  8
+#define PRE_BITS   7
+
+/* A decoding table entry is made of the number of bits of the code in bits
+ * 0-7, the number of extra bits in bits 8-11, the type in bits 12-15, and the
+ * value in bits 16-31. The value is the literal, the base length or distance,
+ * or the position of the second level table, whose size in bits is then
+ * stored in place of the extra bits. Entries of unused codes are T_BAD and
+ * cover the whole table so that they are only reported when enough input was
+ * available to tell.
+ */
+enum { T_LIT, T_LEN, T_EOB, T_SUB, T_BAD };
+
+#define ENTRY(type, val, extra, bits) (((uint32_t)(val) << 16) | ((type) << 12) | ((extra) << 8) | (bits))
+#define E_BITS(e)  ((e) & 0xff)
+#define E_EXTRA(e) (((e) >> 8) & 15)
+#define E_TYPE(e)  (((e) >> 12) & 15)
+#define E_VAL(e)   ((e) >> 16)
+
+/* kinds of tables, which only differ by the entries of their symbols */
+enum { K_PRE, K_LIT, K_DIST };
+
+/* the gzip header flags */
+#define GZ_FHCRC    0x02
+#define GZ_FEXTRA   0x04
+#define GZ_FNAME    0x08
+#define GZ_FCOMMENT 0x10
+
+/* Every write during a match may extend this far past its end */
+#define COPY_SLACK 16
+
+static const uint16_t len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13,
+	15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+	67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+	1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+	4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25,
+	33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+	1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3,
+	4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+	9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* order of the code lengths of the code lengths code (RFC1951 #3.2.7) */
+static const uint8_t pre_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Decoding tables of fixed huffman blocks, built by tools/mkinffix.c. The
+ * longest literal/length code has 9 bits and all distance codes have 5 bits,
+ * so these are the main tables and there is no second level.
+ */
+#define FIX_LIT_BITS  9
+#define FIX_DIST_BITS 5
+
+static const uint32_t fixed_lit[512] = {
+	0x00002007, 0x00500008, 0x00100008, 0x00731408, 0x001f1207, 0x00700008, 0x00300008, 0x00c00009,
+	0x000a1007, 0x00600008, 0x00200008, 0x00a00009, 0x00000008, 0x00800008, 0x00400008, 0x00e00009,
+	0x00061007, 0x00580008, 0x00180008, 0x00900009, 0x003b1307, 0x00780008, 0x00380008, 0x00d00009,
+	0x00111107, 0x00680008, 0x00280008, 0x00b00009, 0x00080008, 0x00880008, 0x00480008, 0x00f00009,
+	0x00041007, 0x00540008, 0x00140008, 0x00e31508, 0x002b1307, 0x00740008, 0x00340008, 0x00c80009,
+	0x000d1107, 0x00640008, 0x00240008, 0x00a80009, 0x00040008, 0x00840008, 0x00440008, 0x00e80009,
+	0x00081007, 0x005c0008, 0x001c0008, 0x00980009, 0x00531407, 0x007c0008, 0x003c0008, 0x00d80009,
+	0x00171207, 0x006c0008, 0x002c0008, 0x00b80009, 0x000c0008, 0x008c0008, 0x004c0008, 0x00f80009,
+	0x00031007, 0x00520008, 0x00120008, 0x00a31508, 0x00231307, 0x00720008, 0x00320008, 0x00c40009,
+	0x000b1107, 0x00620008, 0x00220008, 0x00a40009, 0x00020008, 0x00820008, 0x00420008, 0x00e40009,
+	0x00071007, 0x005a0008, 0x001a0008, 0x00940009, 0x00431407, 0x007a0008, 0x003a0008, 0x00d40009,
+	0x00131207, 0x006a0008, 0x002a0008, 0x00b40009, 0x000a0008, 0x008a0008, 0x004a0008, 0x00f40009,
+	0x00051007, 0x00560008, 0x00160008, 0x00004008, 0x00331307, 0x00760008, 0x00360008, 0x00cc0009,
+	0x000f1107, 0x00660008, 0x00260008, 0x00ac0009, 0x00060008, 0x00860008, 0x00460008, 0x00ec0009,
+	0x00091007, 0x005e0008, 0x001e0008, 0x009c0009, 0x00631407, 0x007e0008, 0x003e0008, 0x00dc0009,
+	0x001b1207, 0x006e0008, 0x002e0008, 0x00bc0009, 0x000e0008, 0x008e0008, 0x004e0008, 0x00fc0009,
+	0x00002007, 0x00510008, 0x00110008, 0x00831508, 0x001f1207, 0x00710008, 0x00310008, 0x00c20009,
+	0x000a1007, 0x00610008, 0x00210008, 0x00a20009, 0x00010008, 0x00810008, 0x00410008, 0x00e20009,
+	0x00061007, 0x00590008, 0x00190008, 0x00920009, 0x003b1307, 0x00790008, 0x00390008, 0x00d20009,
+	0x00111107, 0x00690008, 0x00290008, 0x00b20009, 0x00090008, 0x00890008, 0x00490008, 0x00f20009,
+	0x00041007, 0x00550008, 0x00150008, 0x01021008, 0x002b1307, 0x00750008, 0x00350008, 0x00ca0009,
+	0x000d1107, 0x00650008, 0x00250008, 0x00aa0009, 0x00050008, 0x00850008, 0x00450008, 0x00ea0009,
+	0x00081007, 0x005d0008, 0x001d0008, 0x009a0009, 0x00531407, 0x007d0008, 0x003d0008, 0x00da0009,
+	0x00171207, 0x006d0008, 0x002d0008, 0x00ba0009, 0x000d0008, 0x008d0008, 0x004d0008, 0x00fa0009,
+	0x00031007, 0x00530008, 0x00130008, 0x00c31508, 0x00231307, 0x00730008, 0x00330008, 0x00c60009,
+	0x000b1107, 0x00630008, 0x00230008, 0x00a60009, 0x00030008, 0x00830008, 0x00430008, 0x00e60009,
+	0x00071007, 0x005b0008, 0x001b0008, 0x00960009, 0x00431407, 0x007b0008, 0x003b0008, 0x00d60009,
+	0x00131207, 0x006b0008, 0x002b0008, 0x00b60009, 0x000b0008, 0x008b0008, 0x004b0008, 0x00f60009,
+	0x00051007, 0x00570008, 0x00170008, 0x00004008, 0x00331307, 0x00770008, 0x00370008, 0x00ce0009,
+	0x000f1107, 0x00670008, 0x00270008, 0x00ae0009, 0x00070008, 0x00870008, 0x00470008, 0x00ee0009,
+	0x00091007, 0x005f0008, 0x001f0008, 0x009e0009, 0x00631407, 0x007f0008, 0x003f0008, 0x00de0009,
+	0x001b1207, 0x006f0008, 0x002f0008, 0x00be0009, 0x000f0008, 0x008f0008, 0x004f0008, 0x00fe0009,
+	0x00002007, 0x00500008, 0x00100008, 0x00731408, 0x001f1207, 0x00700008, 0x00300008, 0x00c10009,
+	0x000a1007, 0x00600008, 0x00200008, 0x00a10009, 0x00000008, 0x00800008, 0x00400008, 0x00e10009,
+	0x00061007, 0x00580008, 0x00180008, 0x00910009, 0x003b1307, 0x00780008, 0x00380008, 0x00d10009,
+	0x00111107, 0x00680008, 0x00280008, 0x00b10009, 0x00080008, 0x00880008, 0x00480008, 0x00f10009,
+	0x00041007, 0x00540008, 0x00140008, 0x00e31508, 0x002b1307, 0x00740008, 0x00340008, 0x00c90009,
+	0x000d1107, 0x00640008, 0x00240008, 0x00a90009, 0x00040008, 0x00840008, 0x00440008, 0x00e90009,
+	0x00081007, 0x005c0008, 0x001c0008, 0x00990009, 0x00531407, 0x007c0008, 0x003c0008, 0x00d90009,
+	0x00171207, 0x006c0008, 0x002c0008, 0x00b90009, 0x000c0008, 0x008c0008, 0x004c0008, 0x00f90009,
+	0x00031007, 0x00520008, 0x00120008, 0x00a31508, 0x00231307, 0x00720008, 0x00320008, 0x00c50009,
+	0x000b1107, 0x00620008, 0x00220008, 0x00a50009, 0x00020008, 0x00820008, 0x00420008, 0x00e50009,
+	0x00071007, 0x005a0008, 0x001a0008, 0x00950009, 0x00431407, 0x007a0008, 0x003a0008, 0x00d50009,
+	0x00131207, 0x006a0008, 0x002a0008, 0x00b50009, 0x000a0008, 0x008a0008, 0x004a0008, 0x00f50009,
+	0x00051007, 0x00560008, 0x00160008, 0x00004008, 0x00331307, 0x00760008, 0x00360008, 0x00cd0009,
+	0x000f1107, 0x00660008, 0x00260008, 0x00ad0009, 0x00060008, 0x00860008, 0x00460008, 0x00ed0009,
+	0x00091007, 0x005e0008, 0x001e0008, 0x009d0009, 0x00631407, 0x007e0008, 0x003e0008, 0x00dd0009,
+	0x001b1207, 0x006e0008, 0x002e0008, 0x00bd0009, 0x000e0008, 0x008e0008, 0x004e0008, 0x00fd0009,
+	0x00002007, 0x00510008, 0x00110008, 0x00831508, 0x001f1207, 0x00710008, 0x00310008, 0x00c30009,
+	0x000a1007, 0x00610008, 0x00210008, 0x00a30009, 0x00010008, 0x00810008, 0x00410008, 0x00e30009,
+	0x00061007, 0x00590008, 0x00190008, 0x00930009, 0x003b1307, 0x00790008, 0x00390008, 0x00d30009,
+	0x00111107, 0x00690008, 0x00290008, 0x00b30009, 0x00090008, 0x00890008, 0x00490008, 0x00f30009,
+	0x00041007, 0x00550008, 0x00150008, 0x01021008, 0x002b1307, 0x00750008, 0x00350008, 0x00cb0009,
+	0x000d1107, 0x00650008, 0x00250008, 0x00ab0009, 0x00050008, 0x00850008, 0x00450008, 0x00eb0009,
+	0x00081007, 0x005d0008, 0x001d0008, 0x009b0009, 0x00531407, 0x007d0008, 0x003d0008, 0x00db0009,
+	0x00171207, 0x006d0008, 0x002d0008, 0x00bb0009, 0x000d0008, 0x008d0008, 0x004d0008, 0x00fb0009,
+	0x00031007, 0x00530008, 0x00130008, 0x00c31508, 0x00231307, 0x00730008, 0x00330008, 0x00c70009,
+	0x000b1107, 0x00630008, 0x00230008, 0x00a70009, 0x00030008, 0x00830008, 0x00430008, 0x00e70009,
+	0x00071007, 0x005b0008, 0x001b0008, 0x00970009, 0x00431407, 0x007b0008, 0x003b0008, 0x00d70009,
+	0x00131207, 0x006b0008, 0x002b0008, 0x00b70009, 0x000b0008, 0x008b0008, 0x004b0008, 0x00f70009,
+	0x00051007, 0x00570008, 0x00170008, 0x00004008, 0x00331307, 0x00770008, 0x00370008, 0x00cf0009,
+	0x000f1107, 0x00670008, 0x00270008, 0x00af0009, 0x00070008, 0x00870008, 0x00470008, 0x00ef0009,
+	0x00091007, 0x005f0008, 0x001f0008, 0x009f0009, 0x00631407, 0x007f0008, 0x003f0008, 0x00df0009,
+	0x001b1207, 0x006f0008, 0x002f0008, 0x00bf0009, 0x000f0008, 0x008f0008, 0x004f0008, 0x00ff0009,
+};
+
+static const uint32_t fixed_dist[32] = {
+	0x00011005, 0x01011705, 0x00111305, 0x10011b05, 0x00051105, 0x04011905, 0x00411505, 0x40011d05,
+	0x00031005, 0x02011805, 0x00211405, 0x20011c05, 0x00091205, 0x08011a05, 0x00811605, 0x00004005,
+	0x00021005, 0x01811705, 0x00191305, 0x18011b05, 0x00071105, 0x06011905, 0x00611505, 0x60011d05,
+	0x00041005, 0x03011805, 0x00311405, 0x30011c05, 0x000d1205, 0x0c011a05, 0x00c11605, 0x00004005,
+};
+
+/* The bit reader works on a local copy of the queue which the compiler keeps
+ * in registers, and which is saved back into the stream when leaving. The
+ * queue holds up to 63 bits. On architectures supporting unaligned little
+ * endian accesses, bits_refill() loads 8 bytes at once but only accounts for
+ * the complete bytes that fit, so the bits above <qbits> may contain those of
+ * the next input byte at the position it will be loaded to. Thus anything
+ * advancing <in> without going through the queue must clear it first.
+ */
+struct inf_bits {
+	uint64_t queue;  /* pending bits, LSB first */
+	uint32_t qbits;  /* number of bits in queue */
+	const unsigned char *in;
+	const unsigned char *end;
+};
+
+/* Tries to get at least <n> bits (at most 57) in the queue by loading one byte
+ * at a time. Returns 0 if the input was exhausted first, otherwise 1.
+ */
+static inline int bits_need(struct inf_bits *b, uint32_t n)
+{
+	while (b->qbits < n) {
+		if (b->in == b->end)
+			return 0;
+		b->queue |= (uint64_t)*b->in++ << b->qbits;
+		b->qbits += 8;
+	}
+	return 1;
+}
+
+/* Fills the queue with 56 to 63 bits. At least 8 input bytes must remain. */
+static inline void bits_refill(struct inf_bits *b)
+{
+#ifdef UNALIGNED_LE_OK
+	uint64_t v;
+
+	memcpy(&v, b->in, 8);
+	b->queue |= v << b->qbits;
+	b->in += (63 - b->qbits) >> 3;
+	b->qbits |= 56;
+#else
+	while (b->qbits <= 56) {
+		b->queue |= (uint64_t)*b->in++ << b->qbits;
+		b->qbits += 8;
+	}
+#endif
+}
+
+/* returns the next <n> bits (at most 32) without consuming them */
+static inline uint32_t bits_peek(const struct inf_bits *b, uint32_t n)
+{
+	return b->queue & ((1ULL << n) - 1);
+}
+
+/* consumes <n> bits from the queue */
+static inline void bits_skip(struct inf_bits *b, uint32_t n)
+{
+	b->queue >>= n;
+	b->qbits -= n;
+}
+
+/* returns and consumes the next <n> bits */
+static inline uint32_t bits_get(struct inf_bits *b, uint32_t n)
+{
+	uint32_t v = bits_peek(b, n);
+
+	bits_skip(b, n);
+	return v;
+}
+
+/* Returns the table entry for symbol <sym> of a table of kind <kind>, whose
+ * code has <bits> bits in the table.
+ */
+static uint32_t sym_entry(int kind, int sym, int bits)
+{
+	if (kind == K_PRE)
+		return ENTRY(T_LIT, sym, 0, bits);
+
+	if (kind == K_DIST) {
+		if (sym < 30)
+			return ENTRY(T_LEN, dist_base[sym], dist_extra[sym], bits);
+		return ENTRY(T_BAD, 0, 0, bits);
+	}
+
+	if (sym < 256)
+		return ENTRY(T_LIT, sym, 0, bits);
+	if (sym == 256)
+		return ENTRY(T_EOB, 0, 0, bits);
+	if (sym < 286)
+		return ENTRY(T_LEN, len_base[sym - 257], len_extra[sym - 257], bits);
+	return ENTRY(T_BAD, 0, 0, bits);
+}
+
+/* Builds into <table> of <size> entries the decoding table of kind <kind> for
+ * the <n> code lengths in <lens>, with a main table of <root> bits. Codes are
+ * assigned in the canonical order, and their bit-reversed values are iterated
+ * in that order as well so that each code is directly replicated at all the
+ * indexes it matches. Codes longer than <root> bits sharing the same first
+ * <root> bits are consecutive and go into a second level table sized for all
+ * of them. Incomplete codes are accepted, the unused codes being T_BAD, but
+ * over-subscribed ones are not. Returns 0 on success, or -1 if the lengths
+ * are invalid.
+ */
+static int build_table(uint32_t *table, int size, int root, const uint8_t *lens, int n, int kind)
+{
+	uint16_t count[16], rem[16], offs[16], sorted[288];
+	uint32_t huff, incr, e;
+	int sym, len, max, left, i, j;
+	int next, prefix, off, sub, cur;
+
+	memset(count, 0, sizeof(count));
+	for (sym = 0; sym < n; sym++)
+		count[lens[sym]]++;
+	count[0] = 0;
+
+	left = 1;
+	max = 0;
+	for (len = 1; len <= 15; len++) {
+		left <<= 1;
+		left -= count[len];
+		if (left < 0)
+			return -1;
+		if (count[len])
+			max = len;
+	}
+
+	offs[1] = 0;
+	for (len = 1; len < 15; len++)
+		offs[len + 1] = offs[len] + count[len];
+	for (sym = 0; sym < n; sym++)
+		if (lens[sym])
+			sorted[offs[lens[sym]]++] = sym;
+
+	for (i = 0; i < 1 << root; i++)
+		table[i] = ENTRY(T_BAD, 0, 0, root);
+
+	memcpy(rem, count, sizeof(rem));
+	next = 1 << root;
+	prefix = -1;
+	off = sub = 0;
+	huff = 0;
+	i = 0;
+
+	for (len = 1; len <= max; len++) {
+		for (; rem[len]; rem[len]--, i++) {
+			sym = sorted[i];
+			if (len <= root) {
+				e = sym_entry(kind, sym, len);
+				for (j = huff; j < 1 << root; j += 1 << len)
+					table[j] = e;
+			}
+			else {
+				if ((int)(huff & ((1 << root) - 1)) != prefix) {
+					/* new second level table, large enough for all
+					 * remaining codes starting like this one.
+					 */
+					cur = len - root;
+					left = 1 << cur;
+					while (cur + root < max) {
+						left -= rem[cur + root];
+						if (left <= 0)
+							break;
+						cur++;
+						left <<= 1;
+					}
+
+					if (next + (1 << cur) > size)
+						return -1;
+
+					prefix = huff & ((1 << root) - 1);
+					sub = cur;
+					off = next;
+					next += 1 << sub;
+					table[prefix] = ENTRY(T_SUB, off, sub, root);
+					for (j = 0; j < 1 << sub; j++)
+						table[off + j] = ENTRY(T_BAD, 0, 0, sub);
+				}
+
+				e = sym_entry(kind, sym, len - root);
+				for (j = huff >> root; j < 1 << sub; j += 1 << (len - root))
+					table[off + j] = e;
+			}
+
+			/* next bit-reversed code of <len> bits */
+			incr = 1U << (len - 1);
+			while (huff & incr)
+				incr >>= 1;
+			huff = incr ? (huff & (incr - 1)) + incr : 0;
+		}
+	}
+	return 0;
+}
+
+/* Reads the header of a dynamic huffman block from <b>, the 3 bits of the
+ * block header being already consumed, and builds its tables into <strm>.
+ * Returns 1 on success, 0 if more input is needed, in which case <b> must be
+ * restored by the caller, or -1 if the header is invalid.
+ */
+static int read_dyn_header(struct slz_istream *strm, struct inf_bits *b)
+{
+	uint32_t pre[1 << PRE_BITS];
+	uint8_t lens[286 + 30];
+	uint8_t plens[19];
+	uint32_t e, hlit, hdist, hclen;
+	uint32_t i, rep, val;
+
+	if (!bits_need(b, 14))
+		return 0;
+
+	hlit  = bits_get(b, 5) + 257;
+	hdist = bits_get(b, 5) + 1;
+	hclen = bits_get(b, 4) + 4;
+	if (hlit > 286 || hdist > 30) {
+		strm->msg = "too many length or distance codes";
+		return -1;
+	}
+
+	memset(plens, 0, sizeof(plens));
+	for (i = 0; i < hclen; i++) {
+		if (!bits_need(b, 3))
+			return 0;
+		plens[pre_order[i]] = bits_get(b, 3);
+	}
+
+	if (build_table(pre, 1 << PRE_BITS, PRE_BITS, plens, 19, K_PRE) < 0) {
+		strm->msg = "invalid code lengths code";
+		return -1;
+	}
+
+	for (i = 0; i < hlit + hdist; ) {
+		bits_need(b, PRE_BITS + 7);
+		e = pre[bits_peek(b, PRE_BITS)];
+		if (E_BITS(e) > b->qbits)
+			return 0;
+		if (E_TYPE(e) == T_BAD) {
+			strm->msg = "invalid code length";
+			return -1;
+		}
+		bits_skip(b, E_BITS(e));
+
+		val = E_VAL(e);
+		if (val < 16) {
+			lens[i++] = val;
+			continue;
+		}
+
+		if (val == 16) {
+			if (!i) {
+				strm->msg = "repeated code length without a previous one";
+				return -1;
+			}
+			if (b->qbits < 2)
+				return 0;
+			rep = 3 + bits_get(b, 2);
+			val = lens[i - 1];
+		}
+		else if (val == 17) {
+			if (b->qbits < 3)
+				return 0;
+			rep = 3 + bits_get(b, 3);
+			val = 0;
+		}
+		else {
+			if (b->qbits < 7)
+				return 0;
+			rep = 11 + bits_get(b, 7);
+			val = 0;
+		}
+
+		if (i + rep > hlit + hdist) {
+			strm->msg = "too many code lengths";
+			return -1;
+		}
+		memset(lens + i, val, rep);
+		i += rep;
+	}
+
+	if (!lens[256]) {
+		strm->msg = "missing end of block code";
+		return -1;
+	}
+
+	if (build_table(strm->lit, SLZ_INF_LIT_SIZE, LIT_BITS, lens, hlit, K_LIT) < 0 ||
+	    build_table(strm->dist, SLZ_INF_DIST_SIZE, DIST_BITS, lens + hlit, hdist, K_DIST) < 0) {
+		strm->msg = "invalid literal/length or distance code lengths";
+		return -1;
+	}
+
+	return 1;
+}
+
+/* Copies a match of <len> bytes at distance <dist> to <op>, the first
+ * bytes coming from the window since <dist> is larger than the <op - out>
+ * bytes produced by the current call. The distance must have been checked.
+ * Returns the new output position.
+ */
+static unsigned char *copy_from_window(const struct slz_istream *strm, unsigned char *op,
+                                       const unsigned char *out, uint32_t dist, uint32_t len)
+{
+	uint32_t back = dist - (op - out);
+	uint32_t pos = (strm->wpos - back) & 32767;
+	uint32_t n;
+
+	while (back && len) {
+		n = back < len ? back : len;
+		if (n > 32768 - pos)
+			n = 32768 - pos;
+		memcpy(op, strm->window + pos, n);
+		op   += n;
+		len  -= n;
+		back -= n;
+		pos = (pos + n) & 32767;
+	}
+
+	for (; len; len--, op++)
+		*op = *(op - dist);
+	return op;
+}
+
+/* Copies a match of <len> bytes at distance <dist> to <op>, the source being
+ * entirely in the current output. Up to COPY_SLACK bytes past the end of the
+ * match may be overwritten with unspecified contents. Most copies are done 8
+ * or 16 bytes at a time, including overlapping ones at distances of 8 or more
+ * since each load then only covers bytes already written. These accesses use
+ * memcpy() and not 64-bit words because the compiler may assume that words do
+ * not partially overlap, and vectorize the loop. Returns the new output
+ * position.
+ */
+static inline __attribute__((always_inline))
+unsigned char *copy_match(unsigned char *op, uint32_t dist, uint32_t len)
+{
+	const unsigned char *src = op - dist;
+	unsigned char *end = op + len;
+
+#ifdef UNALIGNED_LE_OK
+	if (__builtin_expect(dist >= 16, 1)) {
+		do {
+			memcpy(op, src, 16);
+			op  += 16;
+			src += 16;
+		} while (op < end);
+		return end;
+	}
+
+	if (dist >= 8) {
+		do {
+			memcpy(op, src, 8);
+			op  += 8;
+			src += 8;
+		} while (op < end);
+		return end;
+	}
+
+	if (dist == 1) {
+		memset(op, src[0], 16);
+		if (len > 16)
+			memset(op + 16, src[0], len - 16);
+		return end;
+	}
+#endif
+	do {
+		*op++ = *src++;
+	} while (op < end);
+	return end;
+}
+
+/* Decodes symbols of the current huffman block one at a time from <b> into
+ * <*opp>, up to <oend>, using the literal/length table <lit> of <lbits> bits
+ * and the distance table <dst> of <dbits> bits. <out> is the start of the
+ * output of the current call, anything before is in the window. Each symbol
+ * is only consumed once complete and once there is room for it, so that this
+ * is usable near the end of the input or output. Returns 1 at the end of the
+ * block, 0 if more input or output space is needed, or -1 on error.
+ */
+static int inflate_tail(struct slz_istream *strm, struct inf_bits *b, unsigned char **opp,
+                        unsigned char *out, unsigned char *oend,
+                        const uint32_t *lit, int lbits, const uint32_t *dst, int dbits)
+{
+	unsigned char *op = *opp;
+	struct inf_bits save;
+	uint32_t e, len, dist;
+
+	while (1) {
+		save = *b;
+		bits_need(b, 48);
+
+		e = lit[bits_peek(b, lbits)];
+		if (E_TYPE(e) == T_SUB) {
+			if (b->qbits < lbits)
+				goto more;
+			bits_skip(b, lbits);
+			e = lit[E_VAL(e) + bits_peek(b, E_EXTRA(e))];
+		}
+		if (E_BITS(e) > b->qbits)
+			goto more;
+		bits_skip(b, E_BITS(e));
+
+		if (E_TYPE(e) == T_LIT) {
+			if (op == oend)
+				goto more;
+			*op++ = E_VAL(e);
+			continue;
+		}
+
+		if (E_TYPE(e) != T_LEN) {
+			if (E_TYPE(e) == T_EOB)
+				goto eob;
+			strm->msg = "invalid literal/length code";
+			goto bad;
+		}
+
+		if (E_EXTRA(e) > b->qbits)
+			goto more;
+		len = E_VAL(e) + bits_get(b, E_EXTRA(e));
+
+		e = dst[bits_peek(b, dbits)];
+		if (E_TYPE(e) == T_SUB) {
+			if (b->qbits < dbits)
+				goto more;
+			bits_skip(b, dbits);
+			e = dst[E_VAL(e) + bits_peek(b, E_EXTRA(e))];
+		}
+		if (E_BITS(e) > b->qbits)
+			goto more;
+		bits_skip(b, E_BITS(e));
+		if (E_TYPE(e) != T_LEN) {
+			strm->msg = "invalid distance code";
+			goto bad;
+		}
+		if (E_EXTRA(e) > b->qbits)
+			goto more;
+		dist = E_VAL(e) + bits_get(b, E_EXTRA(e));
+
+		if (len > oend - op)
+			goto more;
+
+		if (dist > op - out) {
+			if (dist > op - out + strm->wlen) {
+				strm->msg = "invalid distance too far back";
+				goto bad;
+			}
+			op = copy_from_window(strm, op, out, dist, len);
+		}
+		else {
+			for (; len; len--, op++)
+				*op = *(op - dist);
+		}
+	}
+
+ more:
+	*b = save;
+	*opp = op;
+	return 0;
+ eob:
+	*opp = op;
+	return 1;
+ bad:
+	*opp = op;
+	return -1;
+}
+
+/* Decodes the current dynamic huffman block from <b> into <*opp>, up to
+ * <oend>. <out> is the start of the output of the current call, anything
+ * before is in the window. Returns 1 at the end of the block, 0 if more input
+ * or output space is needed, or -1 on error. The main loop runs while there
+ * are enough input bytes and output space for any symbol, so that it only has
+ * to refill the queue once per symbol without checking anything else. The
+ * remaining symbols are left to inflate_tail().
+ */
+static int inflate_huff(struct slz_istream *strm, struct inf_bits *b, unsigned char **opp,
+                        unsigned char *out, unsigned char *oend)
+{
+	const uint32_t *lit = strm->lit;
+	const uint32_t *dst = strm->dist;
+	unsigned char *op = *opp;
+	uint32_t e, len, dist;
+	uint32_t wlen = strm->wlen;
+
+	while (b->end - b->in >= 8 && oend - op >= 258 + COPY_SLACK) {
+		bits_refill(b);
+		e = lit[bits_peek(b, LIT_BITS)];
+		if (__builtin_expect(E_TYPE(e) == T_SUB, 0)) {
+			bits_skip(b, LIT_BITS);
+			e = lit[E_VAL(e) + bits_peek(b, E_EXTRA(e))];
+		}
+		bits_skip(b, E_BITS(e));
+
+		if (E_TYPE(e) == T_LIT) {
+			*op++ = E_VAL(e);
+
+			/* at least 41 bits left, enough for a short literal */
+			e = lit[bits_peek(b, LIT_BITS)];
+			if (E_TYPE(e) == T_LIT) {
+				bits_skip(b, E_BITS(e));
+				*op++ = E_VAL(e);
+			}
+			continue;
+		}
+
+		if (__builtin_expect(E_TYPE(e) != T_LEN, 0)) {
+			if (E_TYPE(e) == T_EOB)
+				goto eob;
+			strm->msg = "invalid literal/length code";
+			goto bad;
+		}
+
+		len = E_VAL(e) + bits_get(b, E_EXTRA(e));
+		e = dst[bits_peek(b, DIST_BITS)];
+		if (__builtin_expect(E_TYPE(e) == T_SUB, 0)) {
+			bits_skip(b, DIST_BITS);
+			e = dst[E_VAL(e) + bits_peek(b, E_EXTRA(e))];
+		}
+		bits_skip(b, E_BITS(e));
+		if (__builtin_expect(E_TYPE(e) != T_LEN, 0)) {
+			strm->msg = "invalid distance code";
+			goto bad;
+		}
+		dist = E_VAL(e) + bits_get(b, E_EXTRA(e));
+
+		if (__builtin_expect(dist > op - out, 0)) {
+			if (dist > op - out + wlen) {
+				strm->msg = "invalid distance too far back";
+				goto bad;
+			}
+			op = copy_from_window(strm, op, out, dist, len);
+			continue;
+		}
+		op = copy_match(op, dist, len);
+	}
+
+	*opp = op;
+	return inflate_tail(strm, b, opp, out, oend, lit, LIT_BITS, dst, DIST_BITS);
+ eob:
+	*opp = op;
+	return 1;
+ bad:
+	*opp = op;
+	return -1;
+}
+
+/* Same as inflate_huff() for fixed huffman blocks, which is what SLZ produces
+ * at levels 0 and 1. The tables are constant and have no second level, and
+ * the codes are short enough for two literals followed by any symbol to fit
+ * in the 56 bits available after a refill (9 + 9 + 8 + 5 + 5 + 13 bits). The
+ * main loop thus decodes up to three symbols per refill, and only checks the
+ * symbol types, literals being the most common case.
+ */
+static int inflate_fixed(struct slz_istream *strm, struct inf_bits *b, unsigned char **opp,
+                         unsigned char *out, unsigned char *oend)
+{
+	unsigned char *op = *opp;
+	uint32_t e, len, dist;
+	uint32_t wlen = strm->wlen;
+
+	while (b->end - b->in >= 8 && oend - op >= 2 + 258 + COPY_SLACK) {
+		bits_refill(b);
+		e = fixed_lit[bits_peek(b, FIX_LIT_BITS)];
+		if (E_TYPE(e) == T_LIT) {
+			bits_skip(b, E_BITS(e));
+			*op++ = E_VAL(e);
+			e = fixed_lit[bits_peek(b, FIX_LIT_BITS)];
+			if (E_TYPE(e) == T_LIT) {
+				bits_skip(b, E_BITS(e));
+				*op++ = E_VAL(e);
+				e = fixed_lit[bits_peek(b, FIX_LIT_BITS)];
+				if (E_TYPE(e) == T_LIT) {
+					bits_skip(b, E_BITS(e));
+					*op++ = E_VAL(e);
+					continue;
+				}
+			}
+		}
+		bits_skip(b, E_BITS(e));
+
+		if (__builtin_expect(E_TYPE(e) != T_LEN, 0)) {
+			if (E_TYPE(e) == T_EOB)
+				goto eob;
+			strm->msg = "invalid literal/length code";
+			goto bad;
+		}
+
+		len = E_VAL(e) + bits_get(b, E_EXTRA(e));
+		e = fixed_dist[bits_peek(b, FIX_DIST_BITS)];
+		bits_skip(b, FIX_DIST_BITS);
+		if (__builtin_expect(E_TYPE(e) != T_LEN, 0)) {
+			strm->msg = "invalid distance code";
+			goto bad;
+		}
+		dist = E_VAL(e) + bits_get(b, E_EXTRA(e));
+
+		if (__builtin_expect(dist > op - out, 0)) {
+			if (dist > op - out + wlen) {
+				strm->msg = "invalid distance too far back";
+				goto bad;
+			}
+			op = copy_from_window(strm, op, out, dist, len);
+			continue;
+		}
+		op = copy_match(op, dist, len);
+	}
+
+	*opp = op;
+	return inflate_tail(strm, b, opp, out, oend, fixed_lit, FIX_LIT_BITS, fixed_dist, FIX_DIST_BITS);
+ eob:
+	*opp = op;
+	return 1;
+ bad:
+	*opp = op;
+	return -1;
+}
+
+/* Appends the <len> bytes from <buf> to the window of stream <strm> */
+static void update_window(struct slz_istream *strm, const unsigned char *buf, long len)
+{
+	uint32_t n;
+
+	if (len >= 32768) {
+		memcpy(strm->window, buf + len - 32768, 32768);
+		strm->wpos = 0;
+		strm->wlen = 32768;
+		return;
+	}
+
+	n = 32768 - strm->wpos;
+	if (n > len)
+		n = len;
+	memcpy(strm->window + strm->wpos, buf, n);
+	memcpy(strm->window, buf + n, len - n);
+	strm->wpos = (strm->wpos + len) & 32767;
+	strm->wlen = strm->wlen + len > 32768 ? 32768 : strm->wlen + len;
+}
+
+/* Initializes inflater <strm> for a stream in format <format>, which must be
+ * one of SLZ_FMT_*.
+ */
+void slz_inflate_init(struct slz_istream *strm, int format)
+{
+	strm->queue  = 0;
+	strm->qbits  = 0;
+	strm->left   = 0;
+	strm->crc32  = (format == SLZ_FMT_ZLIB);
+	strm->olen   = 0;
+	strm->wpos   = 0;
+	strm->wlen   = 0;
+	strm->state  = (format == SLZ_FMT_DEFLATE) ? SLZ_IS_BLOCK : SLZ_IS_HEADER;
+	strm->format = format;
+	strm->last   = 0;
+	strm->flags  = 0;
+	strm->msg    = NULL;
+}
+
+/* Decompresses up to <ilen> bytes from <in> into <out>, which has room for
+ * <osize> bytes, for stream <strm> initialized by slz_inflate_init(). The
+ * stream may be passed in pieces of any size over successive calls, and the
+ * output may be retrieved in pieces of any size, the last 32 kB of output
+ * being kept in the stream for the next calls. The input is only consumed by
+ * complete units (symbols, block headers), so the amount of input consumed is
+ * stored into <used> and the remaining bytes have to be passed again with more
+ * data on the next call. Progress is guaranteed when at least 258 bytes of
+ * output space and 600 bytes of input or the rest of the stream are passed.
+ * The function stops at the end of the stream, which slz_inflate_done()
+ * reports once the trailer was verified, and any data past it is left
+ * unconsumed. It returns the number of bytes produced, or -1 if the stream is
+ * invalid, in which case the reason is in <msg> and the stream is unusable.
+ */
+long slz_inflate(struct slz_istream *strm, void *out, long osize, const void *in, long ilen, long *used)
+{
+	unsigned char *op = out;
+	unsigned char *oend = op + osize;
+	unsigned char *ck = op;
+	struct inf_bits b, save;
+	uint32_t v;
+	long n;
+	int ret;
+
+	b.queue = strm->queue;
+	b.qbits = strm->qbits;
+	b.in    = in;
+	b.end   = b.in + ilen;
+
+	while (1) {
+		save = b;
+
+		switch (strm->state) {
+		case SLZ_IS_HEADER:
+			if (strm->format == SLZ_FMT_ZLIB) {
+				if (!bits_need(&b, 16))
+					goto more;
+				v = bits_get(&b, 16);
+				if ((v & 0x0f) != 8 || (v & 0xf0) > 0x70 ||
+				    (((v & 0xff) << 8) + (v >> 8)) % 31) {
+					strm->msg = "invalid zlib header";
+					goto bad;
+				}
+				if (v & 0x2000) {
+					strm->msg = "preset dictionaries are not supported";
+					goto bad;
+				}
+				strm->state = SLZ_IS_BLOCK;
+				break;
+			}
+
+			if (!bits_need(&b, 32))
+				goto more;
+			v = bits_get(&b, 32);
+			if ((v & 0xffffff) != 0x088b1f || (v >> 24) & 0xe0) {
+				strm->msg = "invalid gzip header";
+				goto bad;
+			}
+			strm->flags = v >> 24;
+
+			/* MTIME, XFL, OS */
+			if (!bits_need(&b, 48)) {
+				b = save;
+				goto more;
+			}
+			bits_skip(&b, 48);
+			strm->left = 0;
+			strm->state = (strm->flags & GZ_FEXTRA) ? SLZ_IS_EXTRA : SLZ_IS_NAME;
+			break;
+
+		case SLZ_IS_EXTRA:
+			if (strm->flags & GZ_FEXTRA) {
+				if (!bits_need(&b, 16))
+					goto more;
+				strm->left = bits_get(&b, 16);
+				strm->flags &= ~GZ_FEXTRA;
+			}
+			for (; strm->left; strm->left--) {
+				if (!bits_need(&b, 8))
+					goto more;
+				bits_skip(&b, 8);
+			}
+			strm->state = SLZ_IS_NAME;
+			break;
+
+		case SLZ_IS_NAME:
+			/* zero-terminated name then comment */
+			while (strm->flags & (GZ_FNAME | GZ_FCOMMENT)) {
+				if (!bits_need(&b, 8))
+					goto more;
+				if (!bits_get(&b, 8))
+					strm->flags &= (strm->flags & GZ_FNAME) ? ~GZ_FNAME : ~GZ_FCOMMENT;
+			}
+			if (strm->flags & GZ_FHCRC) {
+				if (!bits_need(&b, 16))
+					goto more;
+				bits_skip(&b, 16);
+				strm->flags &= ~GZ_FHCRC;
+			}
+			strm->state = SLZ_IS_BLOCK;
+			break;
+
+		case SLZ_IS_BLOCK:
+			if (!bits_need(&b, 3))
+				goto more;
+			strm->last = bits_get(&b, 1);
+
+			switch (bits_get(&b, 2)) {
+			case 0: /* stored: <boundary> LEN16 NLEN16 <data> */
+				bits_skip(&b, b.qbits & 7);
+				if (!bits_need(&b, 32)) {
+					b = save;
+					goto more;
+				}
+				v = bits_get(&b, 32);
+				if ((v & 0xffff) != (~v >> 16)) {
+					strm->msg = "invalid stored block lengths";
+					goto bad;
+				}
+				strm->left = v & 0xffff;
+				strm->state = SLZ_IS_STORED;
+				break;
+			case 1:
+				strm->state = SLZ_IS_FIXED;
+				break;
+			case 2:
+				ret = read_dyn_header(strm, &b);
+				if (ret < 0)
+					goto bad;
+				if (!ret) {
+					b = save;
+					goto more;
+				}
+				strm->state = SLZ_IS_HUFF;
+				break;
+			default:
+				strm->msg = "invalid block type";
+				goto bad;
+			}
+			break;
+
+		case SLZ_IS_STORED:
+			/* the queue only contains whole bytes here */
+			while (strm->left && b.qbits && op < oend) {
+				*op++ = bits_get(&b, 8);
+				strm->left--;
+			}
+
+			if (strm->left && !b.qbits) {
+				b.queue = 0;
+				n = strm->left;
+				if (n > oend - op)
+					n = oend - op;
+				if (n > b.end - b.in)
+					n = b.end - b.in;
+				memcpy(op, b.in, n);
+				op   += n;
+				b.in += n;
+				strm->left -= n;
+			}
+
+			if (strm->left)
+				goto more;
+			strm->state = strm->last ? SLZ_IS_TRAILER : SLZ_IS_BLOCK;
+			break;
+
+		case SLZ_IS_FIXED:
+		case SLZ_IS_HUFF:
+			if (strm->state == SLZ_IS_FIXED)
+				ret = inflate_fixed(strm, &b, &op, out, oend);
+			else
+				ret = inflate_huff(strm, &b, &op, out, oend);
+			if (ret < 0)
+				goto bad;
+			if (!ret)
+				goto more;
+			strm->state = strm->last ? SLZ_IS_TRAILER : SLZ_IS_BLOCK;
+			break;
+
+		case SLZ_IS_TRAILER:
+			if (strm->format == SLZ_FMT_DEFLATE) {
+				strm->state = SLZ_IS_END;
+				break;
+			}
+
+			/* checksum everything up to now */
+			if (strm->format == SLZ_FMT_GZIP)
+				strm->crc32 = slz_crc32(strm->crc32, ck, op - ck);
+			else
+				strm->crc32 = slz_adler32(strm->crc32, ck, op - ck);
+			strm->olen += op - ck;
+			ck = op;
+
+			bits_skip(&b, b.qbits & 7);
+			if (!bits_need(&b, 32))
+				goto more;
+			v = bits_get(&b, 32);
+
+			if (strm->format == SLZ_FMT_ZLIB) {
+				v = __builtin_bswap32(v);
+				if (v != strm->crc32) {
+					strm->msg = "invalid adler32 checksum";
+					goto bad;
+				}
+				strm->state = SLZ_IS_END;
+				break;
+			}
+
+			if (v != strm->crc32) {
+				strm->msg = "invalid crc32 checksum";
+				goto bad;
+			}
+			if (!bits_need(&b, 32)) {
+				b = save;
+				goto more;
+			}
+			if (bits_get(&b, 32) != strm->olen) {
+				strm->msg = "invalid length";
+				goto bad;
+			}
+			strm->state = SLZ_IS_END;
+			break;
+
+		case SLZ_IS_END:
+		case SLZ_IS_ERROR:
+			goto more;
+		}
+	}
+
+ more:
+	/* give back the whole bytes read ahead from this input */
+	n = b.qbits >> 3;
+	if (n > b.in - (const unsigned char *)in)
+		n = b.in - (const unsigned char *)in;
+	b.in    -= n;
+	b.qbits -= n * 8;
+	b.queue &= (1ULL << b.qbits) - 1;
+
+	strm->queue = b.queue;
+	strm->qbits = b.qbits;
+	*used = b.in - (const unsigned char *)in;
+
+	if (strm->format == SLZ_FMT_GZIP)
+		strm->crc32 = slz_crc32(strm->crc32, ck, op - ck);
+	else if (strm->format == SLZ_FMT_ZLIB)
+		strm->crc32 = slz_adler32(strm->crc32, ck, op - ck);
+	strm->olen += op - ck;
+
+	update_window(strm, out, op - (unsigned char *)out);
+	return op - (unsigned char *)out;
+
+ bad:
+	strm->state = SLZ_IS_ERROR;
+	*used = 0;
+	return -1;
+}
@@ -23,6 +23,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +34,40 @@
 #include <sys/user.h>
 #include "slz.h"
 
+/* On x86_64, the variants of the checksum, match length and table reset
+ * functions relying on instruction set extensions are all built using target
+ * attributes, and the most suitable ones are selected at run time depending on
+ * the CPU (see slz_set_cpu()). When built with -DSLZ_NO_DISPATCH, as on other
+ * architectures, only those enabled by the compiler options are available.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(SLZ_NO_DISPATCH)
+#define SLZ_DISPATCH
+#endif
+
+#if defined(SLZ_DISPATCH) || defined(__SSSE3__)
+#define HAVE_SSSE3
+#endif
+
+#if defined(SLZ_DISPATCH) || (defined(__PCLMUL__) && defined(__SSE4_1__))
+#define HAVE_CLMUL
+#endif
+
+#if defined(SLZ_DISPATCH) || defined(__AVX2__)
+#define HAVE_AVX2
+#endif
+
+#if defined(SLZ_DISPATCH) || (defined(HAVE_CLMUL) && defined(__VPCLMULQDQ__) && defined(__AVX2__))
+#define HAVE_VPCLMUL
+#endif
+
+#define TARGET(isa) __attribute__((target(isa)))
+
+#if defined(HAVE_SSSE3) || defined(HAVE_CLMUL) || defined(HAVE_AVX2)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* First, RFC1951-specific declarations and extracts from the RFC.
  *
  * RFC1951 - deflate stream format
@@ -341,7 +376,7 @@ static const uint32_t len_fh[259] = {
  * the CRC already appears inverted in each individual byte and doesn't need
  * to be inverted again in the loop.
  */
-static uint32_t crc32_fast[4][256];
+static uint32_t crc32_fast[16][256];
 static uint32_t fh_dist_table[32768];
 
 /* back references, built in a way that is optimal for 32/64 bits */
@@ -353,6 +388,50 @@ union ref {
 	uint64_t by64;
 };
 
+/* Returns the reference <ref> with its position in the lower 32 bits and its
+ * word in the upper 32 bits. On 64-bit platforms both are loaded at once, so
+ * all accesses to a reference must go through ref_load() and ref_store() for
+ * the two layouts to agree on big endian.
+ */
+static inline uint64_t ref_load(const union ref *ref)
+{
+	if (sizeof(long) >= 8)
+		return ref->by64;
+	return ref->by32.pos + ((uint64_t)ref->by32.word << 32);
+}
+
+/* Stores position <pos> and word <word> into reference <ref> */
+static inline void ref_store(union ref *ref, uint32_t pos, uint32_t word)
+{
+	if (sizeof(long) >= 8) {
+		ref->by64 = ((uint64_t)pos) + ((uint64_t)word << 32);
+	} else {
+		ref->by32.pos  = pos;
+		ref->by32.word = word;
+	}
+}
+
+/* Functions having several implementations depending on the CPU, selected by
+ * slz_set_cpu(). The generic ones are used until then.
+ */
+static long memmatch_word(const unsigned char *a, const unsigned char *b, long max);
+void reset_refs(union ref *refs, long count);
+
+static struct {
+	uint32_t (*crc32)(uint32_t crc, const unsigned char *buf, int len);
+	uint32_t (*adler32)(uint32_t crc, const unsigned char *buf, long len);
+	long (*memmatch)(const unsigned char *a, const unsigned char *b, long max);
+	void (*reset_refs)(union ref *refs, long count);
+} kern = {
+	.crc32      = slz_crc32_by16,
+	.adler32    = slz_adler32_block,
+	.memmatch   = memmatch_word,
+	.reset_refs = reset_refs,
+};
+
+/* kernel set in use, or -1 if not yet selected */
+static int kern_cpu = -1;
+
 /* Returns code for lengths 1 to 32768. The bit size for the next value can be
  * found this way :
  *
@@ -503,6 +582,94 @@ static inline void send_eob(struct slz_stream *strm)
 	send_huff(strm, 256); // cf rfc1951: 256 = EOB
 }
 
+/* The functions above work on the stream itself, whose queue never contains
+ * more than 7 bits between calls. Since every byte written to the output may
+ * alias the stream, they have to reload and store it for each code. The hot
+ * paths instead use a local bit writer which is loaded from the stream using
+ * bits_load(), and which the compiler keeps in registers. It accumulates up to
+ * 63 bits and writes complete bytes 8 at a time using a single store on
+ * architectures supporting unaligned little endian accesses. Thus up to 8
+ * bytes past the current output position may be overwritten with unspecified
+ * contents, which is why the output buffer needs SLZ_OUT_SLACK extra bytes.
+ * It must be saved back into the stream using bits_save() before calling any
+ * function working on the stream.
+ */
+struct slz_bits {
+	uint64_t queue; /* pending bits, LSB first */
+	uint32_t qbits; /* number of bits in queue, < 32 between calls */
+	unsigned char *out;
+};
+
+static inline void bits_load(struct slz_bits *bits, const struct slz_stream *strm)
+{
+	bits->queue = strm->queue;
+	bits->qbits = strm->qbits;
+	bits->out   = strm->outbuf;
+}
+
+/* writes all complete bytes from the queue, leaving at most 7 bits */
+static inline void bits_flush(struct slz_bits *bits)
+{
+#ifdef UNALIGNED_LE_OK
+	*(uint64_t *)bits->out = bits->queue;
+	bits->out   += bits->qbits >> 3;
+	bits->queue >>= bits->qbits & 56;
+	bits->qbits &= 7;
+#else
+	while (bits->qbits >= 8) {
+		*bits->out++ = bits->queue;
+		bits->queue >>= 8;
+		bits->qbits -= 8;
+	}
+#endif
+}
+
+static inline void bits_save(struct slz_bits *bits, struct slz_stream *strm)
+{
+	bits_flush(bits);
+	strm->queue  = bits->queue;
+	strm->qbits  = bits->qbits;
+	strm->outbuf = bits->out;
+}
+
+/* enqueue code x of <xbits> bits (LSB aligned, at most 32). X must not contain
+ * non-zero bits above xbits.
+ */
+static inline void bits_put(struct slz_bits *bits, uint32_t x, uint32_t xbits)
+{
+	bits->queue += (uint64_t)x << bits->qbits;
+	bits->qbits += xbits;
+	if (bits->qbits >= 32)
+		bits_flush(bits);
+}
+
+/* sends fixed huffman code for symbol <code> (0..287) */
+static inline void bits_huff(struct slz_bits *bits, uint32_t code)
+{
+	code = fixed_huff[code];
+	bits_put(bits, code >> 4, code & 15);
+}
+
+/* Encoder statistics of the current thread, see slz_get_stats(). Without
+ * SLZ_STATS, the updates are compiled out.
+ */
+#ifdef SLZ_STATS
+static __thread struct slz_stats thread_stats;
+#define STATS_ADD(field, val) (thread_stats.field += (val))
+#else
+#define STATS_ADD(field, val) do { } while (0)
+#endif
+
+/* accounts for the start of a block of type <btype> (BTYPE) in stream <strm> */
+static inline void stats_block(struct slz_stream *strm, int btype)
+{
+#ifdef SLZ_STATS
+	if (strm->btype && strm->btype != btype + 1)
+		thread_stats.block_switches++;
+	strm->btype = btype + 1;
+#endif
+}
+
 /* copies at most <len> litterals from <buf>, returns the amount of data
  * copied. <more> indicates that there are data past buf + <len>. It must not
  * be called with len <= 0.
@@ -518,6 +685,9 @@ static unsigned int copy_lit(struct slz_stream *strm, const void *buf, int len,
 		send_eob(strm);
 
 	strm->state = more ? SLZ_ST_EOB : SLZ_ST_DONE;
+	stats_block(strm, 0);
+	STATS_ADD(stored_bytes, len);
+	STATS_ADD(lit_bytes, len);
 
 	enqueue8(strm, !more, 3); // BFINAL = !more ; BTYPE = 00
 	flush_bits(strm);
@@ -528,11 +698,29 @@ static unsigned int copy_lit(struct slz_stream *strm, const void *buf, int len,
 	return len;
 }
 
-/* copies at most <len> litterals from <buf>, returns the amount of data
- * copied. <more> indicates that there are data past buf + <len>. It must not
- * be called with len <= 0.
+/* closes the current block if any and sends an empty stored block, which
+ * aligns the output to the next byte boundary without ending the stream. At
+ * most 6 bytes are emitted.
+ */
+static void send_empty_stored(struct slz_stream *strm)
+{
+	if (strm->state != SLZ_ST_EOB)
+		send_eob(strm);
+
+	strm->state = SLZ_ST_EOB;
+	enqueue8(strm, 0, 3); // BFINAL = 0 ; BTYPE = 00
+	flush_bits(strm);
+	copy_16b(strm, 0);      // len
+	copy_16b(strm, 0xffff); // nlen
+}
+
+/* copies at most <len> litterals from <buf> using the local bit writer <bits>,
+ * returns the amount of data copied. <more> indicates that there are data past
+ * buf + <len>. It must not be called with len <= 0. It is always inlined so
+ * that <bits> remains in registers.
  */
-static unsigned int copy_lit_huff(struct slz_stream *strm, const unsigned char *buf, int len, int more)
+static inline __attribute__((always_inline))
+unsigned int copy_lit_huff(struct slz_stream *strm, struct slz_bits *bits, const unsigned char *buf, int len, int more)
 {
 	uint32_t pos;
 
@@ -542,95 +730,574 @@ static unsigned int copy_lit_huff(struct slz_stream *strm, const unsigned char *
 	if (strm->state == SLZ_ST_EOB) {
 	eob:
 		strm->state = more ? SLZ_ST_FIXED : SLZ_ST_LAST;
-		enqueue8(strm, 2 + !more, 3); // BFINAL = !more ; BTYPE = 01
+		stats_block(strm, 1);
+		bits_put(bits, 2 + !more, 3); // BFINAL = !more ; BTYPE = 01
 	}
 	else if (!more) {
-		send_eob(strm);
+		bits_huff(bits, 256); // EOB
 		goto eob;
 	}
 
+	/* fixed huffman literals are 8 or 9 bits long, so 3 of them always
+	 * fit into a single 32-bit put.
+	 */
 	pos = 0;
+	while (pos + 3 <= len) {
+		uint32_t c0 = fixed_huff[buf[pos + 0]];
+		uint32_t c1 = fixed_huff[buf[pos + 1]];
+		uint32_t c2 = fixed_huff[buf[pos + 2]];
+
+		bits_put(bits,
+		         (c0 >> 4) + ((c1 >> 4) << (c0 & 15)) + ((c2 >> 4) << ((c0 & 15) + (c1 & 15))),
+		         (c0 & 15) + (c1 & 15) + (c2 & 15));
+		pos += 3;
+	}
+
 	while (pos < len) {
-		send_huff(strm, buf[pos++]);
+		bits_huff(bits, buf[pos++]);
 	}
+	STATS_ADD(huff_bytes, len);
+	STATS_ADD(lit_bytes, len);
 	return len;
 }
 
-/* format:
- * bit0..31  = word
- * bit32..63 = last position in buffer of similar content
+/* Dynamic huffman encoding (BTYPE=10), used from level 2. Matches are not sent
+ * on the fly but recorded as sequences made of a number of literals followed
+ * by a match. The literals themselves are not copied, they are read again
+ * from the input buffer when the block is sent, so a sequence is only 8 bytes
+ * long. Frequencies are accumulated while parsing, then the block is emitted
+ * using the cheapest of dynamic, fixed or stored encodings once the sequence
+ * table is full or the input is exhausted. Everything is on the stack and
+ * nothing survives the call, just like the references table.
+ *
+ * RFC1951 3.2.7 - Compression with dynamic Huffman codes (BTYPE=10)
+
+         5 Bits: HLIT, # of Literal/Length codes - 257 (257 - 286)
+         5 Bits: HDIST, # of Distance codes - 1        (1 - 32)
+         4 Bits: HCLEN, # of Code Length codes - 4     (4 - 19)
+
+         (HCLEN + 4) x 3 bits: code lengths for the code length
+            alphabet given just above, in the order: 16, 17, 18,
+            0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+
+         HLIT + 257 code lengths for the literal/length alphabet,
+            encoded using the code length Huffman code
+
+         HDIST + 1 code lengths for the distance alphabet,
+            encoded using the code length Huffman code
+
+         The actual compressed data of the block,
+            encoded using the literal/length and distance Huffman
+            codes
+
+         The literal/length symbol 256 (end of data),
+            encoded using the literal/length Huffman code
+
+               0 - 15: Represent code lengths of 0 - 15
+                   16: Copy the previous code length 3 - 6 times.
+                       The next 2 bits indicate repeat length
+                   17: Repeat a code length of 0 for 3 - 10 times.
+                       (3 bits of length)
+                   18: Repeat a code length of 0 for 11 - 138 times
+                       (7 bits of length)
  */
 
-/* This hash provides good average results on HTML contents, and is among the
- * few which provide almost optimal results on various different pages.
+/* max number of sequences per dynamic block, this defines the stack usage */
+#define SLZ_DYN_SEQS 4096
+
+/* matches at least this long are emitted without trying lazy matching */
+#define SLZ_LAZY_NICE 64
+
+/* in fast mode, after 2^SLZ_SKIP_SHIFT consecutive positions without a match,
+ * one extra byte is skipped per lookup, and one more after each such series,
+ * up to SLZ_SKIP_MAX extra bytes.
+ */
+#ifndef SLZ_SKIP_SHIFT
+#define SLZ_SKIP_SHIFT 5
+#endif
+#ifndef SLZ_SKIP_MAX
+#define SLZ_SKIP_MAX 32
+#endif
+
+/* the gzip and zlib checksums are computed by tiles of this size just before
+ * they are compressed, so that they're still in the L1 cache.
+ */
+#ifndef SLZ_CK_TILE
+#define SLZ_CK_TILE 16384
+#endif
+
+/* slz_encode_partial() does not compress chunks shorter than this, except the
+ * first and the last ones, as the cost of the call would dominate. 256 bytes
+ * fill 4 kB buffers to about 93% with text.
+ */
+#ifndef SLZ_PARTIAL_MIN
+#define SLZ_PARTIAL_MIN 256
+#endif
+
+/* slz_encodev() gathers consecutive segments shorter than SLZ_IOV_SMALL bytes
+ * into stack buffers of SLZ_IOV_GATHER bytes before compressing them. With
+ * text cut into segments of up to 3 kB, 1 kB/8 kB loses 15% of ratio and
+ * 4 kB/16 kB less than 1%.
+ */
+#ifndef SLZ_IOV_SMALL
+#define SLZ_IOV_SMALL 4096
+#endif
+#ifndef SLZ_IOV_GATHER
+#define SLZ_IOV_GATHER 16384
+#endif
+
+/* <lit> literals followed by a match of <len> bytes at distance <dist>. A
+ * zero length indicates trailing literals only.
+ */
+struct slz_seq {
+	uint32_t lit;
+	uint16_t len;
+	uint16_t dist;
+};
+
+struct slz_dyn {
+	uint32_t lfreq[288];  /* literal/length symbol frequencies */
+	uint32_t dfreq[32];   /* distance symbol frequencies */
+	uint32_t nseq;        /* number of sequences in seq[] */
+	struct slz_seq seq[SLZ_DYN_SEQS];
+};
+
+/* order in which code length code lengths are sent */
+static const uint8_t clen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* number of extra bits for length codes 257..285 */
+static const uint8_t len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+/* number of extra bits for distance codes 0..29 */
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* sends huffman code <code> made of the code in bits 4..19 and its size in
+ * bits 0..3 (same format as fixed_huff[]).
  */
-static inline uint32_t slz_hash(uint32_t a)
+static inline void send_code(struct slz_bits *bits, uint32_t code)
 {
-	return ((a << 19) + (a << 6) - a) >> (32 - HASH_BITS);
+	bits_put(bits, code >> 4, code & 15);
 }
 
-/* This function compares buffers <a> and <b> and reads 32 or 64 bits at a time
- * during the approach. It makes us of unaligned little endian memory accesses
- * on capable architectures. <max> is the maximum number of bytes that can be
- * read, so both <a> and <b> must have at least <max> bytes ahead. <max> may
- * safely be null or negative if that simplifies computations in the caller.
+/* Sorts the <n> keys from <keys> in ascending order using an LSB radix sort
+ * on 8-bit digits. <tmp> must be able to store as many keys. The returned
+ * pointer is either <keys> or <tmp> depending on where the result ended.
  */
-static inline long memmatch(const unsigned char *a, const unsigned char *b, long max)
+static uint32_t *radix_sort(uint32_t *keys, uint32_t *tmp, int n)
 {
-	long len = 0;
+	uint32_t count[256];
+	uint32_t *src = keys, *dst = tmp, *swp;
+	uint32_t total, c;
+	int shift, i;
+
+	for (shift = 0; shift < 32; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(src[i] >> shift) & 0xff]++;
+
+		/* all keys share the same digit, nothing to do */
+		if (count[(src[0] >> shift) & 0xff] == n)
+			continue;
 
-#ifdef UNALIGNED_LE_OK
-	unsigned long xor;
+		for (total = i = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = total;
+			total += c;
+		}
 
-	while (1) {
-		if (len + 2 * sizeof(long) > max) {
-			while (len < max) {
-				if (a[len] != b[len])
-					break;
-				len++;
+		for (i = 0; i < n; i++)
+			dst[count[(src[i] >> shift) & 0xff]++] = src[i];
+
+		swp = src; src = dst; dst = swp;
+	}
+	return src;
+}
+
+/* Computes the optimal huffman code lengths in place for the <n> weights in
+ * <a> sorted in ascending order, using the in-place algorithm described by
+ * A. Moffat and J. Katajainen in "In-Place Calculation of Minimum-Redundancy
+ * Codes" (1995). Upon return, a[i] contains the length of the code for the
+ * symbol of weight a[i]. <n> must be at least 2.
+ */
+static void huff_lengths(uint32_t *a, int n)
+{
+	int root, leaf, next, avail, used, depth;
+
+	/* first pass, left to right: build the tree's internal nodes */
+	a[0] += a[1];
+	root = 0;
+	leaf = 2;
+	for (next = 1; next < n - 1; next++) {
+		if (leaf >= n || a[root] < a[leaf]) {
+			a[next] = a[root];
+			a[root++] = next;
+		}
+		else
+			a[next] = a[leaf++];
+
+		if (leaf >= n || (root < next && a[root] < a[leaf])) {
+			a[next] += a[root];
+			a[root++] = next;
+		}
+		else
+			a[next] += a[leaf++];
+	}
+
+	/* second pass, right to left: internal nodes depths */
+	a[n - 2] = 0;
+	for (next = n - 3; next >= 0; next--)
+		a[next] = a[a[next]] + 1;
+
+	/* third pass, right to left: leaves depths */
+	avail = 1;
+	used = depth = 0;
+	root = n - 2;
+	next = n - 1;
+	while (avail > 0) {
+		while (root >= 0 && a[root] == depth) {
+			used++;
+			root--;
+		}
+		while (avail > used) {
+			a[next--] = depth;
+			avail--;
+		}
+		avail = 2 * used;
+		depth++;
+		used = 0;
+	}
+}
+
+/* Builds the canonical huffman codes for the <nsym> symbols whose frequencies
+ * are in <freq>, with code lengths limited to <maxbits> (at most 15). Symbols
+ * of null frequency get no code, except that at least two codes are always
+ * produced so that the decoder always sees a complete code. The codes are
+ * stored into <codes> using the same format as fixed_huff[], that is the
+ * length in bits 0..3 and the reversed code in bits 4..19.
+ */
+static void build_huff(const uint32_t *freq, int nsym, int maxbits, uint32_t *codes)
+{
+	uint32_t keys[288], tmp[288], weight[288];
+	uint32_t count[33], next[16];
+	uint32_t *sorted;
+	uint32_t maxf, total, code, rev;
+	int shift, len, n, i, j;
+
+	/* frequencies are scaled down if needed so that the weight and the
+	 * symbol fit in a 32-bit key and the weights sum cannot overflow.
+	 */
+	for (maxf = i = 0; i < nsym; i++)
+		if (freq[i] > maxf)
+			maxf = freq[i];
+
+	for (shift = 0; (maxf >> shift) >= (1U << 22); shift++)
+		;
+
+	for (n = i = 0; i < nsym; i++) {
+		codes[i] = 0;
+		if (freq[i])
+			keys[n++] = ((freq[i] >> shift ? freq[i] >> shift : 1) << 9) + i;
+	}
+
+	for (i = 0; n < 2; i++)
+		if (!freq[i])
+			keys[n++] = (1 << 9) + i;
+
+	sorted = radix_sort(keys, tmp, n);
+	for (i = 0; i < n; i++)
+		weight[i] = sorted[i] >> 9;
+
+	huff_lengths(weight, n);
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		count[weight[i] > 32 ? 32 : weight[i]]++;
+
+	/* Limit the lengths to maxbits. Too long codes are first shortened to
+	 * maxbits, then the Kraft sum is fixed by moving leaves down the tree
+	 * one at a time, each move taking one unit away from the total.
+	 */
+	for (i = maxbits + 1; i <= 32; i++) {
+		count[maxbits] += count[i];
+		count[i] = 0;
+	}
+
+	for (total = 0, i = maxbits; i > 0; i--)
+		total += count[i] << (maxbits - i);
+
+	while (total != (1U << maxbits)) {
+		count[maxbits]--;
+		for (i = maxbits - 1; i > 0; i--) {
+			if (count[i]) {
+				count[i]--;
+				count[i + 1] += 2;
+				break;
 			}
-			return len;
 		}
+		total--;
+	}
 
-		xor = *(long *)&a[len] ^ *(long *)&b[len];
-		if (xor)
-			break;
-		len += sizeof(long);
+	/* the least frequent symbols get the longest codes */
+	for (j = 0, len = maxbits; len > 0; len--)
+		for (i = count[len]; i > 0; i--)
+			codes[sorted[j++] & 511] = len;
 
-		xor = *(long *)&a[len] ^ *(long *)&b[len];
-		if (xor)
-			break;
-		len += sizeof(long);
+	/* now assign the canonical codes, as described in RFC1951 3.2.2 */
+	for (code = 0, len = 1; len <= maxbits; len++) {
+		code = (code + count[len - 1]) << 1;
+		next[len] = code;
+	}
+
+	for (i = 0; i < nsym; i++) {
+		len = codes[i];
+		if (!len)
+			continue;
+		code = next[len]++;
+		for (rev = j = 0; j < len; j++, code >>= 1)
+			rev = (rev << 1) + (code & 1);
+		codes[i] = (rev << 4) + len;
+	}
+}
+
+/* Run-length encodes the <n> code lengths from <lens> using the code length
+ * alphabet. Each entry is stored in <rle> as the symbol (0..18) in bits 0..4
+ * and the repeat count's extra bits in bits 5 and above. Symbol frequencies
+ * are accumulated into <freq>. The number of entries is returned.
+ */
+static int rle_lengths(const uint8_t *lens, int n, uint16_t *rle, uint32_t *freq)
+{
+	int out = 0;
+	int run, rep;
+	uint8_t l;
+
+	while (n > 0) {
+		l = *lens;
+		for (run = 1; run < n && lens[run] == l; run++)
+			;
+		lens += run;
+		n -= run;
+
+		if (!l) {
+			while (run >= 11) {
+				rep = run > 138 ? 138 : run;
+				rle[out++] = 18 + ((rep - 11) << 5);
+				freq[18]++;
+				run -= rep;
+			}
+			if (run >= 3) {
+				rle[out++] = 17 + ((run - 3) << 5);
+				freq[17]++;
+				run = 0;
+			}
+		}
+		else {
+			rle[out++] = l;
+			freq[l]++;
+			run--;
+			while (run >= 3) {
+				rep = run > 6 ? 6 : run;
+				rle[out++] = 16 + ((rep - 3) << 5);
+				freq[16]++;
+				run -= rep;
+			}
+		}
+
+		while (run-- > 0) {
+			rle[out++] = l;
+			freq[l]++;
+		}
+	}
+	return out;
+}
+
+/* Sends the block described by <dyn> whose data start at <in>. BFINAL is set
+ * if <last> is not null. The block is sent using the cheapest encoding among
+ * dynamic huffman, fixed huffman and stored, based on the exact bit counts.
+ * The sequences and frequencies are reset so that a new block may start. The
+ * stream's state must be SLZ_ST_EOB on entry, and is SLZ_ST_EOB or SLZ_ST_DONE
+ * on return depending on <last>.
+ */
+static void dyn_flush(struct slz_stream *strm, struct slz_dyn *dyn, const unsigned char *in, int last)
+{
+	static const uint8_t rle_bits[3] = { 2, 3, 7 };
+	uint32_t lcodes[288], dcodes[32], ccodes[19], cfreq[19];
+	uint8_t lens[286 + 30];
+	uint16_t rle[286 + 30];
+	uint64_t dyn_bits, fix_bits, raw_bits, extra;
+	uint32_t hlit, hdist, hclen, nrle;
+	uint32_t blen, code, dist, i, n;
+	const struct slz_seq *seq;
+	struct slz_bits bits;
+
+	dyn->lfreq[256] = 1; // EOB
+	build_huff(dyn->lfreq, 286, 15, lcodes);
+	build_huff(dyn->dfreq, 30, 15, dcodes);
+
+	for (hlit = 286; hlit > 257 && !(lcodes[hlit - 1] & 15); hlit--)
+		;
+	for (hdist = 30; hdist > 1 && !(dcodes[hdist - 1] & 15); hdist--)
+		;
+
+	for (i = 0; i < hlit; i++)
+		lens[i] = lcodes[i] & 15;
+	for (i = 0; i < hdist; i++)
+		lens[hlit + i] = dcodes[i] & 15;
+
+	memset(cfreq, 0, sizeof(cfreq));
+	nrle = rle_lengths(lens, hlit + hdist, rle, cfreq);
+	build_huff(cfreq, 19, 7, ccodes);
+
+	for (hclen = 19; hclen > 4 && !(ccodes[clen_order[hclen - 1]] & 15); hclen--)
+		;
+
+	/* extra bits are the same for fixed and dynamic codes */
+	extra = 0;
+	for (i = 0; i < 29; i++)
+		extra += (uint64_t)dyn->lfreq[257 + i] * len_extra[i];
+	for (i = 0; i < 30; i++)
+		extra += (uint64_t)dyn->dfreq[i] * dist_extra[i];
+
+	dyn_bits = 3 + 5 + 5 + 4 + 3 * hclen + extra;
+	fix_bits = 3 + extra;
+	for (i = 0; i < nrle; i++) {
+		dyn_bits += ccodes[rle[i] & 31] & 15;
+		if ((rle[i] & 31) >= 16)
+			dyn_bits += rle_bits[(rle[i] & 31) - 16];
+	}
+	for (i = 0; i < 286; i++) {
+		dyn_bits += (uint64_t)dyn->lfreq[i] * (lcodes[i] & 15);
+		fix_bits += (uint64_t)dyn->lfreq[i] * (fixed_huff[i] & 15);
+	}
+	for (i = 0; i < 30; i++) {
+		dyn_bits += (uint64_t)dyn->dfreq[i] * (dcodes[i] & 15);
+		fix_bits += (uint64_t)dyn->dfreq[i] * 5;
+	}
+
+	for (blen = i = 0; i < dyn->nseq; i++)
+		blen += dyn->seq[i].lit + dyn->seq[i].len;
+
+	/* stored blocks cost 3 bits, alignment, then LEN+NLEN every 64kB */
+	raw_bits = ((uint64_t)blen + 5 * ((blen + 65534) / 65535)) * 8;
+
+	if (raw_bits <= dyn_bits && raw_bits <= fix_bits) {
+		while (blen) {
+			n = copy_lit(strm, in, blen, !last);
+			in += n;
+			blen -= n;
+		}
+		goto reset;
+	}
+
+	bits_load(&bits, strm);
+	if (fix_bits <= dyn_bits) {
+		for (i = 0; i < 288; i++)
+			lcodes[i] = fixed_huff[i];
+		for (i = 0; i < 30; i++)
+			dcodes[i] = (dist_codes[i] << 4) + 5;
+		stats_block(strm, 1);
+		bits_put(&bits, 2 + !!last, 3); // BFINAL = last ; BTYPE = 01
+	}
+	else {
+		stats_block(strm, 2);
+		bits_put(&bits, 4 + !!last, 3); // BFINAL = last ; BTYPE = 10
+		bits_put(&bits, hlit - 257, 5);
+		bits_put(&bits, hdist - 1, 5);
+		bits_put(&bits, hclen - 4, 4);
+		for (i = 0; i < hclen; i++)
+			bits_put(&bits, ccodes[clen_order[i]] & 15, 3);
+
+		for (i = 0; i < nrle; i++) {
+			code = rle[i] & 31;
+			send_code(&bits, ccodes[code]);
+			if (code >= 16)
+				bits_put(&bits, rle[i] >> 5, rle_bits[code - 16]);
+		}
 	}
 
-	if (sizeof(long) > 4 && !(xor & 0xffffffff)) {
-		/* This code is optimized out on 32-bit archs, but we still
-		 * need to shift in two passes to avoid a warning. It is
-		 * properly optimized out as a single shift.
+	for (seq = dyn->seq; seq < dyn->seq + dyn->nseq; seq++) {
+		/* literal codes are at most 15 bits long, so they are sent
+		 * two at a time.
 		 */
-		xor >>= 16; xor >>= 16;
-		if (xor & 0xffff) {
-			if (xor & 0xff)
-				return len + 4;
-			return len + 5;
+		for (n = seq->lit; n >= 2; n -= 2) {
+			uint32_t c0 = lcodes[in[0]];
+			uint32_t c1 = lcodes[in[1]];
+
+			bits_put(&bits, (c0 >> 4) + ((c1 >> 4) << (c0 & 15)), (c0 & 15) + (c1 & 15));
+			in += 2;
 		}
-		if (xor & 0xffffff)
-			return len + 6;
-		return len + 7;
+		if (n)
+			send_code(&bits, lcodes[*in++]);
+		STATS_ADD(lit_bytes, seq->lit);
+
+		if (!seq->len)
+			continue;
+		STATS_ADD(matches, 1);
+		STATS_ADD(match_len, seq->len);
+
+		code = len_code[seq->len];
+		send_code(&bits, lcodes[257 + (code & 0x1f)]);
+		bits_put(&bits, code >> 8, (code >> 5) & 7);
+
+		dist = fh_dist_table[seq->dist - 1];
+		send_code(&bits, dcodes[dist_codes[(dist >> 5) & 0x1f]]);
+		bits_put(&bits, dist >> 10, (dist & 0x1f) - 5);
+		in += seq->len;
 	}
 
-	if (xor & 0xffff) {
-		if (xor & 0xff)
-			return len;
-		return len + 1;
+	send_code(&bits, lcodes[256]); // EOB
+	bits_save(&bits, strm);
+	strm->state = last ? SLZ_ST_DONE : SLZ_ST_EOB;
+
+ reset:
+	memset(dyn->lfreq, 0, sizeof(dyn->lfreq));
+	memset(dyn->dfreq, 0, sizeof(dyn->dfreq));
+	dyn->nseq = 0;
+}
+
+/* format:
+ * bit0..31  = word
+ * bit32..63 = last position in buffer of similar content
+ */
+
+/* This hash provides good average results on HTML contents, and is among the
+ * few which provide almost optimal results on various different pages. It
+ * returns a value of <bits> bits, which is a constant in all callers.
+ */
+static inline uint32_t slz_hash(uint32_t a, const int bits)
+{
+	return ((a << 19) + (a << 6) - a) >> (32 - bits);
+}
+
+/* Generic version of memmatch(), comparing unaligned little endian 32 or 64-bit
+ * words on capable architectures, the position of the first difference being
+ * the number of trailing zeroes of their xor divided by 8. The remaining bytes
+ * which do not fill a word are compared one at a time.
+ */
+static long memmatch_word(const unsigned char *a, const unsigned char *b, long max)
+{
+	long len = 0;
+
+#ifdef UNALIGNED_LE_OK
+	unsigned long xor;
+
+	while (len + (long)sizeof(long) <= max) {
+		xor = *(unsigned long *)&a[len] ^ *(unsigned long *)&b[len];
+		if (xor)
+			return len + (__builtin_ctzl(xor) >> 3);
+		len += sizeof(long);
 	}
-	if (xor & 0xffffff)
-		return len + 2;
-	return len + 3;
+#endif
 
-#else // UNALIGNED_LE_OK
 	/* This is the generic version for big endian or unaligned-incompatible
-	 * architectures.
+	 * architectures, and for the last bytes.
 	 */
 	while (len < max) {
 		if (a[len] != b[len])
@@ -638,8 +1305,78 @@ static inline long memmatch(const unsigned char *a, const unsigned char *b, long
 		len++;
 	}
 	return len;
+}
+
+#if defined(__SSE2__)
+/* SSE2 version of memmatch(), comparing 16 bytes at once. The position of the
+ * first difference is found by counting the trailing zeroes in the negated
+ * comparison mask.
+ */
+static long memmatch_sse2(const unsigned char *a, const unsigned char *b, long max)
+{
+	uint32_t mask;
+	long len = 0;
+
+	while (len + 16 <= max) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + len)),
+		                                        _mm_loadu_si128((const __m128i *)(b + len))));
+		if (mask != 0xffff)
+			return len + __builtin_ctz(~mask);
+		len += 16;
+	}
+	return len + memmatch_word(a + len, b + len, max - len);
+}
+#endif
+
+#if defined(HAVE_AVX2)
+/* AVX2 version of memmatch(), comparing 32 bytes at once, then 16 */
+static TARGET("avx2")
+long memmatch_avx2(const unsigned char *a, const unsigned char *b, long max)
+{
+	uint32_t mask;
+	long len = 0;
 
+	while (len + 32 <= max) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + len)),
+		                                              _mm256_loadu_si256((const __m256i *)(b + len))));
+		if (mask != 0xffffffff)
+			return len + __builtin_ctz(~mask);
+		len += 32;
+	}
+
+	while (len + 16 <= max) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + len)),
+		                                        _mm_loadu_si128((const __m128i *)(b + len))));
+		if (mask != 0xffff)
+			return len + __builtin_ctz(~mask);
+		len += 16;
+	}
+	return len + memmatch_word(a + len, b + len, max - len);
+}
+#endif
+
+/* This function compares buffers <a> and <b> and returns the number of bytes
+ * they have in common. <max> is the maximum number of bytes that can be read,
+ * so both <a> and <b> must have at least <max> bytes ahead. <max> may safely be
+ * null or negative if that simplifies computations in the caller. Since most
+ * matches are short, when SSE2 is available the first 16 bytes are compared
+ * inline, and only longer matches are passed to the memmatch function selected
+ * for the CPU (up to 32 bytes at once with AVX2).
+ */
+static inline long memmatch(const unsigned char *a, const unsigned char *b, long max)
+{
+#if defined(__SSE2__)
+	uint32_t mask;
+
+	if (max >= 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+		                                        _mm_loadu_si128((const __m128i *)b)));
+		if (mask != 0xffff)
+			return __builtin_ctz(~mask);
+		return 16 + kern.memmatch(a + 16, b + 16, max - 16);
+	}
 #endif
+	return memmatch_word(a, b, max);
 }
 
 /* sets <count> BYTES to -32769 in <refs> so that any uninitialized entry will
@@ -674,65 +1411,219 @@ void reset_refs(union ref *refs, long count)
 	} while (refs < end);
 }
 
-/* Compresses <ilen> bytes from <in> into <out> according to RFC1951. The
- * output result may be up to 5 bytes larger than the input, to which 2 extra
- * bytes may be added to send the last chunk due to BFINAL+EOB encoding (10
- * bits) when <more> is not set. The caller is responsible for ensuring there
- * is enough room in the output buffer for this. The amount of output bytes is
- * returned, and no CRC is computed.
- */
-long slz_rfc1951_encode(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more)
+#if defined(HAVE_AVX2)
+/* AVX2 version of reset_refs(), writing 32 bytes at once */
+static TARGET("avx2")
+void reset_refs_avx2(union ref *refs, long count)
 {
-	long rem = ilen;
-	unsigned long pos = 0;
-	unsigned long last;
-	uint32_t word = 0;
-	long mlen;
-	uint32_t h;
-	uint64_t ent;
+	const __m256i v = _mm256_set1_epi64x(-32769);
+	const void *end = (void *)refs + count;
 
-	uint32_t len;
-	uint32_t plit = 0;
-	uint32_t bit9 = 0;
-	uint32_t dist, code;
-	union ref refs[1 << HASH_BITS];
+	do {
+		_mm256_storeu_si256((__m256i *)refs + 0, v);
+		_mm256_storeu_si256((__m256i *)refs + 1, v);
+		_mm256_storeu_si256((__m256i *)refs + 2, v);
+		_mm256_storeu_si256((__m256i *)refs + 3, v);
+		refs += 16;
+	} while ((void *)refs < end);
+}
+#endif
 
-	if (!strm->level) {
-		/* force to send as literals (eg to preserve CPU) */
-		strm->outbuf = out;
-		plit = pos = ilen;
-		bit9 = 52; /* force literal dump */
-		goto final_lit_dump;
+/* Indexes the <hlen> bytes of history from <hist> into <refs> at positions 0
+ * to <hlen>-4, so that the input which follows may reference them. The input
+ * then starts at position <hlen>. <ways> is the number of entries per bucket
+ * and <hbits> the log2 of the table size.
+ */
+static inline __attribute__((always_inline))
+void index_hist(union ref *refs, const unsigned char *hist, unsigned long hlen, const int ways, const int hbits)
+{
+	union ref *bucket;
+	unsigned long pos;
+	uint32_t word;
+	int i;
+
+	for (pos = 0; pos + 4 <= hlen; pos++) {
+#ifdef UNALIGNED_LE_OK
+		word = *(uint32_t *)&hist[pos];
+#else
+		word = hist[pos] + (hist[pos + 1] << 8) + (hist[pos + 2] << 16) + ((uint32_t)hist[pos + 3] << 24);
+#endif
+		if (ways > 1) {
+			bucket = refs + (slz_hash(word, hbits) & -ways);
+			for (i = ways - 1; i > 0; i--)
+				bucket[i] = bucket[i - 1];
+			ref_store(&bucket[0], pos, word);
+		} else {
+			ref_store(&refs[slz_hash(word, hbits)], pos, word);
+		}
 	}
+}
+
+/* Returns the length of the match between the input at <pos> and the reference
+ * at position <last> which is known to match on the first 4 bytes, for at most
+ * <max> bytes (4 to 258). See rfc1951_encode() for <hist> and <hlen>.
+ */
+static inline __attribute__((always_inline))
+long match_len(const unsigned char *in, unsigned long pos, unsigned long last, long max,
+               const unsigned char *hist, unsigned long hlen)
+{
+	long mlen;
+
+	if (!hlen || last >= hlen)
+		return memmatch(in + pos + 4, in + last - hlen + 4, max - 4) + 4;
+
+	/* the match starts in the history and may continue at the beginning
+	 * of the input buffer.
+	 */
+	if (max <= hlen - last)
+		return memmatch(in + pos + 4, hist + last + 4, max - 4) + 4;
 
-	reset_refs(refs, sizeof(refs));
+	mlen = memmatch(in + pos + 4, hist + last + 4, hlen - last - 4) + 4;
+	if (mlen == hlen - last)
+		mlen += memmatch(in + pos + mlen, in, max - mlen);
+	return mlen;
+}
+
+/* Looks up the references table for word <word> found at <pos>, and records
+ * this occurrence in place of the oldest entry of its bucket of <ways> entries.
+ * The length of the longest valid match is returned (0 if none), and <last> is
+ * set to its position. See rfc1951_encode() for <hist>, <hlen> and <hbits>.
+ */
+static inline __attribute__((always_inline))
+long find_match(union ref *refs, const unsigned char *in, unsigned long pos, long rem, uint32_t word,
+                const unsigned char *hist, unsigned long hlen, const int ways, const int hbits,
+                unsigned long *last)
+{
+	union ref *bucket = refs + (slz_hash(word, hbits) & -ways);
+	long max = rem > 258 ? 258 : rem;
+	unsigned long cand;
+	uint64_t ent;
+	long mlen = 0;
+	long len;
+	int i;
+
+	/* entries are sorted from the most recent to the oldest one */
+	for (i = 0; i < ways; i++) {
+		ent = ref_load(&bucket[i]);
+		if ((uint32_t)(ent >> 32) != word) {
+			STATS_ADD(rejected_hits, 1);
+			continue;
+		}
+		cand = (uint32_t)ent;
+		if ((unsigned long)(pos + hlen - cand - 1) >= 32768)
+			continue;
+		len = match_len(in, pos, cand, max, hist, hlen);
+		if (len > mlen) {
+			mlen = len;
+			*last = cand;
+			if (mlen == max)
+				break;
+		}
+	}
+
+	for (i = ways - 1; i > 0; i--)
+		bucket[i] = bucket[i - 1];
+	ref_store(&bucket[0], pos + hlen, word);
+	return mlen;
+}
+
+static inline uint32_t update_crc(uint32_t crc, const void *buf, int len);
+static inline uint32_t update_adler(uint32_t crc, const unsigned char *buf, long len);
+
+/* updates the checksum of stream <strm> on <buf, len> according to its format */
+static inline void update_sum(struct slz_stream *strm, const unsigned char *buf, long len)
+{
+	if (strm->format == SLZ_FMT_GZIP)
+		strm->crc32 = update_crc(strm->crc32, buf, len);
+	else if (strm->format == SLZ_FMT_ZLIB)
+		strm->crc32 = update_adler(strm->crc32, buf, len);
+}
+
+/* This is the encoder's main loop, which is always inlined so that its
+ * variants are specialized at build time. When <dyn> is NULL, the output is
+ * directly sent as fixed huffman or stored blocks (levels 0 and 1). Otherwise
+ * the sequences are accumulated into <dyn> and sent as dynamic blocks. When
+ * <hlen> is not null, the <hlen> bytes from <hist> are considered as being the
+ * data which immediately precede <in> in the stream, and references to them
+ * are permitted. Positions in the references table are then offset by <hlen>.
+ * <ways> is the number of entries per hash bucket. With 1, only the last
+ * occurrence of each hashed word is known. With more, the <ways> most recent
+ * entries sharing the same bucket are kept together in the same cache line,
+ * and the longest match among them is used. When <lazy> is not null, up to
+ * <lazy> following positions are checked for a longer match before a match
+ * shorter than SLZ_LAZY_NICE is emitted, and the current byte is sent as a
+ * literal if one is found. <refs> is the references table, made of 2^<hbits>
+ * entries, which is initialized here. When <ck> is set, the stream's checksum
+ * is updated by tiles of SLZ_CK_TILE bytes just before they are compressed,
+ * so that the input is only read once from memory. Level 0 is not handled
+ * here, see rfc1951_encode_stored().
+ */
+static inline __attribute__((always_inline))
+long rfc1951_encode(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                    struct slz_dyn *dyn, const unsigned char *hist, unsigned long hlen, const int ways,
+                    union ref *refs, const int hbits, int ck)
+{
+	const int lazy = strm->lazy;
+	const int fast = strm->fast;
+	long rem = ilen;
+	unsigned long pos = 0;
+	unsigned long last;
+	uint32_t word = 0;
+	long mlen;
+	uint32_t h;
+	uint64_t ent;
+
+	uint32_t len;
+	uint32_t plit = 0;
+	uint32_t bit9 = 0;
+	uint32_t dist, code;
+	unsigned long bstart = 0;
+	unsigned long cand;
+	uint32_t next;
+	long max, nlen;
+	int depth;
+	uint32_t misses = 0;
+	uint32_t step;
+	unsigned long ckpos = ck ? 0 : ilen;
+	struct slz_bits bits;
+
+	kern.reset_refs(refs, sizeof(*refs) << hbits);
+	if (hlen)
+		index_hist(refs, hist, hlen, ways, hbits);
 
 	strm->outbuf = out;
+	bits_load(&bits, strm);
 
 #ifndef UNALIGNED_FASTER
 	word = ((unsigned char)in[pos] << 8) + ((unsigned char)in[pos + 1] << 16) + ((unsigned char)in[pos + 2] << 24);
 #endif
 	while (rem >= 4) {
+		if (__builtin_expect(pos >= ckpos, 0)) {
+			/* checksum the next tile while it's being loaded */
+			len = ilen - ckpos > SLZ_CK_TILE ? SLZ_CK_TILE : ilen - ckpos;
+			update_sum(strm, in + ckpos, len);
+			ckpos += len;
+		}
 #ifndef UNALIGNED_FASTER
 		word = ((unsigned char)in[pos + 3] << 24) + (word >> 8);
 #else
 		word = *(uint32_t *)&in[pos];
 #endif
-		h = slz_hash(word);
+		h = slz_hash(word, hbits);
 		asm volatile ("" ::); // prevent gcc from trying to be smart with the prefetch
 
-		if (sizeof(long) >= 8) {
-			ent = refs[h].by64;
-			last = (uint32_t)ent;
-			ent >>= 32;
-			refs[h].by64 = ((uint64_t)pos) + ((uint64_t)word << 32);
-		} else {
-			ent  = refs[h].by32.word;
-			last = refs[h].by32.pos;
-			refs[h].by32.pos = pos;
-			refs[h].by32.word = word;
+		if (ways > 1) {
+			mlen = find_match(refs, in, pos, rem, word, hist, hlen, ways, hbits, &last);
+			if (!mlen)
+				goto send_as_lit;
+			goto found;
 		}
 
+		ent = ref_load(&refs[h]);
+		last = (uint32_t)ent;
+		ent >>= 32;
+		ref_store(&refs[h], pos + hlen, word);
+
 #if FIND_OPTIMAL_MATCH
 		/* Experimental code to see what could be saved with an ideal
 		 * longest match lookup algorithm. This one is very slow but
@@ -780,22 +1671,89 @@ long slz_rfc1951_encode(struct slz_stream *strm, unsigned char *out, const unsig
 #endif
 
 		if ((uint32_t)ent != word) {
+			STATS_ADD(rejected_hits, 1);
 		send_as_lit:
 			rem--;
 			plit++;
-			bit9 += ((unsigned char)word >= 144);
+			if (dyn)
+				dyn->lfreq[(unsigned char)word]++;
+			else
+				bit9 += ((unsigned char)word >= 144);
 			pos++;
+
+			/* in fast mode, the longer we go without a match, the more
+			 * bytes are directly sent as literals without being looked
+			 * up nor indexed.
+			 */
+			if (fast) {
+				step = misses++ >> SLZ_SKIP_SHIFT;
+				if (step > SLZ_SKIP_MAX)
+					step = SLZ_SKIP_MAX;
+				if (step && rem > step + 4) {
+					rem  -= step;
+					plit += step;
+					do {
+						if (dyn)
+							dyn->lfreq[in[pos++]]++;
+						else
+							bit9 += (in[pos++] >= 144);
+					} while (--step);
+#ifndef UNALIGNED_FASTER
+					word = ((unsigned char)in[pos] << 8) + ((unsigned char)in[pos + 1] << 16) + ((unsigned char)in[pos + 2] << 24);
+#endif
+				}
+			}
 			continue;
 		}
 
 		/* We reject pos = last and pos > last+32768 */
-		if ((unsigned long)(pos - last - 1) >= 32768)
+		if ((unsigned long)(pos + hlen - last - 1) >= 32768)
 			goto send_as_lit;
 
 		/* Note: cannot encode a length larger than 258 bytes */
-		mlen = memmatch(in + pos + 4, in + last + 4, (rem > 258 ? 258 : rem) - 4) + 4;
+		max = rem > 258 ? 258 : rem;
+		mlen = match_len(in, pos, last, max, hist, hlen);
+
+	found:
+		/* found a matching entry, check if a longer one starts at the
+		 * next position(s), in which case the current byte is sent as a
+		 * literal instead.
+		 */
+		for (depth = lazy; depth && mlen < SLZ_LAZY_NICE && rem > 4; depth--) {
+			next = (word >> 8) + ((uint32_t)in[pos + 4] << 24);
+			nlen = find_match(refs, in, pos + 1, rem - 1, next, hist, hlen, ways, hbits, &cand);
+			if (nlen <= mlen)
+				break;
+
+			rem--;
+			plit++;
+			if (dyn)
+				dyn->lfreq[(unsigned char)word]++;
+			else
+				bit9 += ((unsigned char)word >= 144);
+			pos++;
+			word = next;
+			mlen = nlen;
+			last = cand;
+		}
 
-		/* found a matching entry */
+		if (dyn) {
+			/* the block is sent once the sequence table is full */
+			dyn->seq[dyn->nseq].lit  = plit;
+			dyn->seq[dyn->nseq].len  = mlen;
+			dyn->seq[dyn->nseq].dist = pos + hlen - last;
+			dyn->nseq++;
+			dyn->lfreq[257 + (len_code[mlen] & 0x1f)]++;
+			dyn->dfreq[dist_codes[(fh_dist_table[pos + hlen - last - 1] >> 5) & 0x1f]]++;
+			plit = 0;
+			if (dyn->nseq == SLZ_DYN_SEQS) {
+				bits_save(&bits, strm);
+				dyn_flush(strm, dyn, in + bstart, 0);
+				bits_load(&bits, strm);
+				bstart = pos + mlen;
+			}
+			goto skip_match;
+		}
 
 		if (bit9 >= 52 && mlen < 6)
 			goto send_as_lit;
@@ -806,7 +1764,7 @@ long slz_rfc1951_encode(struct slz_stream *strm, unsigned char *out, const unsig
 		code = len_fh[mlen];
 
 		/* direct mapping of dist->huffman code */
-		dist = fh_dist_table[pos - last - 1];
+		dist = fh_dist_table[pos + hlen - last - 1];
 
 		/* if encoding the dist+length is more expensive than sending
 		 * the equivalent as bytes, lets keep the literals.
@@ -823,10 +1781,13 @@ long slz_rfc1951_encode(struct slz_stream *strm, unsigned char *out, const unsig
 			 * block. Only use plain literals if there are more than 52 bits
 			 * to save then.
 			 */
-			if (bit9 >= 52)
+			if (bit9 >= 52) {
+				bits_save(&bits, strm);
 				len = copy_lit(strm, in + pos - plit, plit, 1);
+				bits_load(&bits, strm);
+			}
 			else
-				len = copy_lit_huff(strm, in + pos - plit, plit, 1);
+				len = copy_lit_huff(strm, &bits, in + pos - plit, plit, 1);
 
 			plit -= len;
 		}
@@ -834,15 +1795,20 @@ long slz_rfc1951_encode(struct slz_stream *strm, unsigned char *out, const unsig
 		/* use mode 01 - fixed huffman */
 		if (strm->state == SLZ_ST_EOB) {
 			strm->state = SLZ_ST_FIXED;
-			enqueue8(strm, 0x02, 3); // BTYPE = 01, BFINAL = 0
+			stats_block(strm, 1);
+			bits_put(&bits, 0x02, 3); // BTYPE = 01, BFINAL = 0
 		}
+		STATS_ADD(matches, 1);
+		STATS_ADD(match_len, mlen);
 
-		/* copy the length first */
-		enqueue16(strm, code & 0xFFFF, code >> 16);
-
-		/* in fixed huffman mode, dist is fixed 5 bits */
-		enqueue16(strm, dist >> 5, dist & 0x1f);
+		/* send the length (up to 13 bits) followed by the distance, which
+		 * in fixed huffman mode is a fixed 5 bits code followed by up to
+		 * 13 extra bits, all at once.
+		 */
+		bits_put(&bits, (code & 0xFFFF) + ((dist >> 5) << (code >> 16)), (code >> 16) + (dist & 0x1f));
+	skip_match:
 		bit9 = 0;
+		misses = 0;
 		rem -= mlen;
 		pos += mlen;
 
@@ -855,33 +1821,463 @@ long slz_rfc1951_encode(struct slz_stream *strm, unsigned char *out, const unsig
 #endif
 	}
 
+	if (ckpos < ilen)
+		update_sum(strm, in + ckpos, ilen - ckpos);
+
 	if (__builtin_expect(rem, 0)) {
 		/* we're reading the 1..3 last bytes */
 		plit += rem;
 		do {
-			bit9 += ((unsigned char)in[pos++] >= 144);
+			if (dyn)
+				dyn->lfreq[in[pos++]]++;
+			else
+				bit9 += ((unsigned char)in[pos++] >= 144);
 		} while (--rem);
 	}
 
- final_lit_dump:
+	if (dyn) {
+		if (plit) {
+			dyn->seq[dyn->nseq].lit = plit;
+			dyn->seq[dyn->nseq].len = 0;
+			dyn->nseq++;
+		}
+		if (dyn->nseq) {
+			bits_save(&bits, strm);
+			dyn_flush(strm, dyn, in + bstart, !more);
+			bits_load(&bits, strm);
+		}
+		goto end;
+	}
+
 	/* now copy remaining literals or mark the end */
 	while (plit) {
-		if (bit9 >= 52)
+		if (bit9 >= 52) {
+			bits_save(&bits, strm);
 			len = copy_lit(strm, in + pos - plit, plit, more);
+			bits_load(&bits, strm);
+		}
 		else
-			len = copy_lit_huff(strm, in + pos - plit, plit, more);
+			len = copy_lit_huff(strm, &bits, in + pos - plit, plit, more);
 
 		plit -= len;
 	}
 
+ end:
+	bits_save(&bits, strm);
 	strm->ilen += ilen;
 	return strm->outbuf - out;
 }
 
+/* Returns the log2 of the number of entries of the references table to use for
+ * <ilen> bytes of input following <hlen> bytes of history. This is the stream's
+ * setting, except that since the table has to be reset on each call, for small
+ * inputs it is shrunk as long as it keeps at least 4 entries per position. This
+ * way a 256-byte input only resets 8 kB instead of 64 kB, at the expense of a
+ * few extra collisions.
+ */
+static inline int refs_bits(const struct slz_stream *strm, long ilen, unsigned long hlen)
+{
+	int hbits = (strm->hbits < SLZ_HASH_BITS_MIN) ? HASH_BITS : strm->hbits;
+
+	while (hbits > SLZ_HASH_BITS_MIN && ilen + hlen <= (1L << (hbits - 3)))
+		hbits--;
+	return hbits;
+}
+
+/* Calls the variant of rfc1951_encode() matching the references table size
+ * <hbits> so that the table size and the hash shift remain constants in each
+ * of them. <refs> must have 2^<hbits> entries.
+ */
+static inline __attribute__((always_inline))
+long rfc1951_encode_bits(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                         struct slz_dyn *dyn, const unsigned char *hist, unsigned long hlen, const int ways,
+                         union ref *refs, int hbits, int ck)
+{
+	switch (hbits) {
+	case 10: return rfc1951_encode(strm, out, in, ilen, more, dyn, hist, hlen, ways, refs, 10, ck);
+	case 11: return rfc1951_encode(strm, out, in, ilen, more, dyn, hist, hlen, ways, refs, 11, ck);
+	case 12: return rfc1951_encode(strm, out, in, ilen, more, dyn, hist, hlen, ways, refs, 12, ck);
+	case 14: return rfc1951_encode(strm, out, in, ilen, more, dyn, hist, hlen, ways, refs, 14, ck);
+	case 15: return rfc1951_encode(strm, out, in, ilen, more, dyn, hist, hlen, ways, refs, 15, ck);
+	default: return rfc1951_encode(strm, out, in, ilen, more, dyn, hist, hlen, ways, refs, 13, ck);
+	}
+}
+
+/* Level 2 and above use dynamic huffman blocks, whose sequences are
+ * accumulated into <dyn>, which is initialized here. Level 3 uses 4-way
+ * buckets.
+ */
+static inline __attribute__((always_inline))
+long rfc1951_encode_dyn(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                        struct slz_dyn *dyn, const unsigned char *hist, unsigned long hlen, const int ways,
+                        union ref *refs, int hbits, int ck)
+{
+	memset(dyn->lfreq, 0, sizeof(dyn->lfreq));
+	memset(dyn->dfreq, 0, sizeof(dyn->dfreq));
+	dyn->nseq = 0;
+	return rfc1951_encode_bits(strm, out, in, ilen, more, dyn, hist, hlen, ways, refs, hbits, ck);
+}
+
+/* The variants for each level, with and without history, are kept out of line
+ * so that the entry points using the stack or a workspace share them.
+ */
+static __attribute__((noinline))
+long rfc1951_encode_lvl1(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                         union ref *refs, int hbits, int ck)
+{
+	return rfc1951_encode_bits(strm, out, in, ilen, more, NULL, NULL, 0, 1, refs, hbits, ck);
+}
+
+static __attribute__((noinline))
+long rfc1951_encode_lvl1_hist(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                              const unsigned char *hist, unsigned long hlen, union ref *refs, int hbits, int ck)
+{
+	return rfc1951_encode_bits(strm, out, in, ilen, more, NULL, hist, hlen, 1, refs, hbits, ck);
+}
+
+static __attribute__((noinline))
+long rfc1951_encode_lvl2(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                         struct slz_dyn *dyn, union ref *refs, int hbits, int ck)
+{
+	return rfc1951_encode_dyn(strm, out, in, ilen, more, dyn, NULL, 0, 1, refs, hbits, ck);
+}
+
+static __attribute__((noinline))
+long rfc1951_encode_lvl2_hist(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                              struct slz_dyn *dyn, const unsigned char *hist, unsigned long hlen,
+                              union ref *refs, int hbits, int ck)
+{
+	return rfc1951_encode_dyn(strm, out, in, ilen, more, dyn, hist, hlen, 1, refs, hbits, ck);
+}
+
+static __attribute__((noinline))
+long rfc1951_encode_lvl3(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                         struct slz_dyn *dyn, union ref *refs, int hbits, int ck)
+{
+	return rfc1951_encode_dyn(strm, out, in, ilen, more, dyn, NULL, 0, 4, refs, hbits, ck);
+}
+
+static __attribute__((noinline))
+long rfc1951_encode_lvl3_hist(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                              struct slz_dyn *dyn, const unsigned char *hist, unsigned long hlen,
+                              union ref *refs, int hbits, int ck)
+{
+	return rfc1951_encode_dyn(strm, out, in, ilen, more, dyn, hist, hlen, 4, refs, hbits, ck);
+}
+
+/* Calls the variant matching the stream's level, with the history only if
+ * <hlen> is not null. <refs> has 2^<hbits> entries, and <dyn> is only used by
+ * levels 2 and above.
+ */
+static inline long rfc1951_encode_lvl(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                                      struct slz_dyn *dyn, const unsigned char *hist, unsigned long hlen,
+                                      union ref *refs, int hbits, int ck)
+{
+	if (strm->level >= 3)
+		return hlen ? rfc1951_encode_lvl3_hist(strm, out, in, ilen, more, dyn, hist, hlen, refs, hbits, ck) :
+		              rfc1951_encode_lvl3(strm, out, in, ilen, more, dyn, refs, hbits, ck);
+	if (strm->level == 2)
+		return hlen ? rfc1951_encode_lvl2_hist(strm, out, in, ilen, more, dyn, hist, hlen, refs, hbits, ck) :
+		              rfc1951_encode_lvl2(strm, out, in, ilen, more, dyn, refs, hbits, ck);
+	return hlen ? rfc1951_encode_lvl1_hist(strm, out, in, ilen, more, hist, hlen, refs, hbits, ck) :
+	              rfc1951_encode_lvl1(strm, out, in, ilen, more, refs, hbits, ck);
+}
+
+/* Levels 2 and above require some space on the stack to accumulate the
+ * sequences, so this is done out of line to keep the stack usage low for
+ * other levels.
+ */
+static __attribute__((noinline))
+long rfc1951_encode_stack_dyn(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                              const unsigned char *hist, unsigned long hlen, union ref *refs, int hbits, int ck)
+{
+	struct slz_dyn dyn;
+
+	return rfc1951_encode_lvl(strm, out, in, ilen, more, &dyn, hist, hlen, refs, hbits, ck);
+}
+
+/* Magic numbers of common formats whose contents are already compressed. The
+ * first byte is the length of the magic, which is checked at the offset given
+ * by the second byte. This covers gzip, zstd, xz, bzip2, zip, 7z, JPEG, GIF,
+ * WebP, WOFF/WOFF2 and MP4 (ftyp). PNG is not part of it because many PNG
+ * files still compress by 5 to 20%, so these are left to the sampling. Zip
+ * files are only matched by incomp_magic_match() if their first entry is not
+ * stored.
+ */
+static const uint8_t incomp_magic[][10] = {
+	{ 2, 0, 0x1f, 0x8b },
+	{ 4, 0, 0x28, 0xb5, 0x2f, 0xfd },
+	{ 6, 0, 0xfd, '7', 'z', 'X', 'Z', 0x00 },
+	{ 3, 0, 'B', 'Z', 'h' },
+	{ 4, 0, 'P', 'K', 0x03, 0x04 },
+	{ 6, 0, '7', 'z', 0xbc, 0xaf, 0x27, 0x1c },
+	{ 3, 0, 0xff, 0xd8, 0xff },
+	{ 4, 0, 'G', 'I', 'F', '8' },
+	{ 4, 8, 'W', 'E', 'B', 'P' },
+	{ 4, 0, 'w', 'O', 'F', 'F' },
+	{ 4, 0, 'w', 'O', 'F', '2' },
+	{ 4, 4, 'f', 't', 'y', 'p' },
+};
+
+/* Returns non-zero if the <ilen> bytes from <in> start with one of the magic
+ * numbers of incomp_magic[]. The zip signature is only accepted when the
+ * compression method of the first local file header (bytes 8-9) is not 0,
+ * since archives made of stored entries (zip -0, some JARs and APKs) compress
+ * as well as their contents.
+ */
+static int incomp_magic_match(const unsigned char *in, long ilen)
+{
+	unsigned long i, n;
+
+	for (i = 0; i < sizeof(incomp_magic) / sizeof(incomp_magic[0]); i++) {
+		n = incomp_magic[i][0] + incomp_magic[i][1];
+		if (ilen < n || memcmp(in + incomp_magic[i][1], incomp_magic[i] + 2, incomp_magic[i][0]) != 0)
+			continue;
+		if (in[0] == 'P' && (ilen < 10 || (in[8] | in[9]) == 0))
+			return 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Returns non-zero if the same 4-byte word is found at two of about 256
+ * positions of the <len> bytes from <in>. One position is picked at random
+ * within each 1/256 of the input, so that the distances between them are not
+ * multiples of the same interval, and a random sequence repeated every few kB
+ * is almost always caught. The words are indexed in a small table where slot
+ * 0 is empty, to keep the test branchless. Colliding words overwrite each
+ * other, which only causes a few repeats to be missed.
+ */
+static int incomp_repeats(const unsigned char *in, long len)
+{
+	uint8_t slot[512];
+	uint32_t word[256];
+	unsigned long n, pos, step;
+	uint32_t rnd, w, h, rep;
+
+	memset(slot, 0, sizeof(slot));
+	step = (len / 256) | 1;
+	rnd = 0x2545f491;
+	rep = word[0] = 0;
+	for (n = 1; n < 256; n++) {
+		rnd = rnd * 1103515245 + 12345;
+		pos = n * step + (((uint64_t)rnd * step) >> 32);
+		if (pos + 4 > len)
+			break;
+		w = in[pos] | (in[pos + 1] << 8) | (in[pos + 2] << 16) | ((uint32_t)in[pos + 3] << 24);
+		h = (w * 0x9e3779b1U) >> 23;
+		rep |= (slot[h] != 0) & (word[slot[h]] == w);
+		word[n] = w;
+		slot[h] = n;
+	}
+	return rep;
+}
+
+/* Returns non-zero if the <len> bytes from <in> look incompressible. About 256
+ * bytes are sampled at an odd interval so that the samples are not aligned
+ * with fixed-size records. For each sample the number of previous samples of
+ * the same value is added, which gives the number of pairs of identical
+ * samples. Compressed or encrypted data have an almost uniform byte
+ * distribution, leading to about 1/256 of all pairs, while text, code and
+ * executables have at least 7 times more, and usually 10 to 50. The input is
+ * considered incompressible below 1.5 times the uniform rate, unless
+ * incomp_repeats() finds repeated strings, which the byte distribution does
+ * not show.
+ */
+static int incomp_sample(const unsigned char *in, long len)
+{
+	uint16_t hist[256];
+	unsigned long pairs, n, i, step;
+
+	memset(hist, 0, sizeof(hist));
+	step = (len / 256) | 1;
+	pairs = n = 0;
+	for (i = 0; i < len && n < 256; i += step, n++)
+		pairs += hist[in[i]]++;
+
+	/* pairs/(n*(n-1)/2) < 1.5/256 */
+	if (pairs * 1024 >= 3 * n * (n - 1))
+		return 0;
+
+	return !incomp_repeats(in, len);
+}
+
+/* Returns non-zero if the <ilen> bytes from <in> are predicted not to compress,
+ * in which case it is cheaper to send them as stored blocks without even
+ * looking for matches. Inputs of at least SLZ_INCOMP_MIN bytes are sampled
+ * using incomp_sample(), by regions of SLZ_INCOMP_REGION bytes so that large
+ * inputs mixing compressible and incompressible parts are compressed. If
+ * <start> is set, <in> is the beginning of the data, and a magic number of an
+ * already compressed format then stands for the sampling of the first region
+ * only, whatever its size. The input is incompressible only if all regions
+ * are. The cost is about 1 to 2% of the compression of 1 kB at level 1. The
+ * only data which may still be wrongly predicted are random sequences repeated
+ * at long distances, close to the 32 kB window, which the samples may miss.
+ */
+int slz_incompressible(const unsigned char *in, long ilen, int start)
+{
+	int magic = start && incomp_magic_match(in, ilen);
+	long len;
+
+	if (!magic && ilen < SLZ_INCOMP_MIN)
+		return 0;
+
+	for (; ilen; in += len, ilen -= len) {
+		len = ilen;
+		/* a small last region is merged with the previous one */
+		if (len >= SLZ_INCOMP_REGION + SLZ_INCOMP_MIN)
+			len = SLZ_INCOMP_REGION;
+		if (magic)
+			magic = 0;
+		else if (!incomp_sample(in, len))
+			return 0;
+	}
+	return 1;
+}
+
+/* Sends the <ilen> bytes from <in> as stored blocks, for level 0 or when they
+ * are predicted not to compress. When <ck> is set, the stream's checksum is
+ * updated on each block before copying it.
+ */
+static long rfc1951_encode_stored(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more, int ck)
+{
+	long plit = ilen;
+
+	strm->outbuf = out;
+	while (plit) {
+		if (ck)
+			update_sum(strm, in + ilen - plit, plit > 65535 ? 65535 : plit);
+		plit -= copy_lit(strm, in + ilen - plit, plit, more);
+	}
+
+	strm->ilen += ilen;
+	return strm->outbuf - out;
+}
+
+/* Implements slz_rfc1951_encode_hist(), and when <ck> is set, also updates
+ * the stream's checksum according to its format while compressing.
+ */
+static long rfc1951_encode_hist_ck(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                                   const unsigned char *hist, long hlen, int ck)
+{
+	int hbits;
+
+	if (hlen > 32768) {
+		hist += hlen - 32768;
+		hlen = 32768;
+	}
+
+	if (hlen < 4 || !strm->level)
+		hlen = 0;
+
+	strm->incomp = strm->level && !strm->noscan && slz_incompressible(in, ilen, !strm->ilen);
+	if (strm->incomp || !strm->level)
+		return rfc1951_encode_stored(strm, out, in, ilen, more, ck);
+
+	hbits = refs_bits(strm, ilen, hlen);
+
+	{
+		union ref refs[1 << hbits] __attribute__((aligned(64)));
+
+		if (strm->level >= 2)
+			return rfc1951_encode_stack_dyn(strm, out, in, ilen, more, hist, hlen, refs, hbits, ck);
+		return rfc1951_encode_lvl(strm, out, in, ilen, more, NULL, hist, hlen, refs, hbits, ck);
+	}
+}
+
+/* Implements slz_rfc1951_encode_ws(), and when <ck> is set, also updates the
+ * stream's checksum according to its format while compressing.
+ */
+static long rfc1951_encode_ws_ck(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                                 const unsigned char *hist, long hlen, void *ws, int ck)
+{
+	union ref *refs = ws;
+	int hbits;
+
+	if (hlen > 32768) {
+		hist += hlen - 32768;
+		hlen = 32768;
+	}
+
+	if (hlen < 4 || !strm->level)
+		hlen = 0;
+
+	strm->incomp = strm->level && !strm->noscan && slz_incompressible(in, ilen, !strm->ilen);
+	if (strm->incomp || !strm->level)
+		return rfc1951_encode_stored(strm, out, in, ilen, more, ck);
+
+	hbits = refs_bits(strm, ilen, hlen);
+	return rfc1951_encode_lvl(strm, out, in, ilen, more, (struct slz_dyn *)(refs + (1 << hbits)), hist, hlen, refs, hbits, ck);
+}
+
+/* Compresses <ilen> bytes from <in> into <out> according to RFC1951. The
+ * output result may be up to 1/8 larger than the input plus a few bytes, see
+ * slz_bound(). The caller is responsible for ensuring there is enough room in
+ * the output buffer for this, including SLZ_OUT_SLACK bytes past the end which
+ * may be overwritten with unspecified contents. The amount of output bytes is
+ * returned, and no CRC is computed. The references table is allocated on the
+ * stack (64 kB by default, 100 kB for levels 2 and above), otherwise see
+ * slz_rfc1951_encode_ws().
+ */
+long slz_rfc1951_encode(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more)
+{
+	return slz_rfc1951_encode_hist(strm, out, in, ilen, more, NULL, 0);
+}
+
+/* Same as slz_rfc1951_encode() except that the <hlen> bytes from <hist> are
+ * used as a history window that matches may reference, allowing distances to
+ * reach back into the data passed to previous calls. These bytes must exactly
+ * be the last <hlen> bytes of uncompressed data already sent into this stream,
+ * or the output will not decode. Only the last 32 kB are used, and less than 4
+ * bytes are ignored. It is the caller's responsibility to keep this buffer up
+ * to date, per stream, but since the cost of indexing the history is
+ * proportional to its size, there is little point in passing much more than
+ * what is being compressed. Level 0 ignores the history.
+ *
+ * When enabled by slz_set_prescan(), inputs which slz_incompressible() predicts
+ * as not compressible are directly sent as stored blocks, which is indicated
+ * by the stream's <incomp> flag.
+ */
+long slz_rfc1951_encode_hist(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                             const unsigned char *hist, long hlen)
+{
+	return rfc1951_encode_hist_ck(strm, out, in, ilen, more, hist, hlen, 0);
+}
+
+/* Same as slz_rfc1951_encode_hist() except that the references table and the
+ * other temporary data are placed into the workspace <ws> instead of the
+ * stack. <hist> may be NULL if <hlen> is zero. The workspace must be at least
+ * as large as reported by slz_workspace_size() for the stream's level and hash
+ * table size, and should be aligned to 64 bytes. Its contents only matter
+ * during the call, so a thread may share a single workspace between all of its
+ * streams.
+ */
+long slz_rfc1951_encode_ws(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                           const unsigned char *hist, long hlen, void *ws)
+{
+	return rfc1951_encode_ws_ck(strm, out, in, ilen, more, hist, hlen, ws, 0);
+}
+
+/* Returns the size in bytes of the workspace that slz_rfc1951_encode_ws() and
+ * its gzip and zlib variants need for a stream using level <level> and a hash
+ * table of 2^<hbits> entries as set by slz_init_ex(), or HASH_BITS by default.
+ * The size for level 3 and SLZ_HASH_BITS_MAX suits all streams.
+ */
+long slz_workspace_size(int level, int hbits)
+{
+	if (hbits < SLZ_HASH_BITS_MIN)
+		hbits = SLZ_HASH_BITS_MIN;
+	else if (hbits > SLZ_HASH_BITS_MAX)
+		hbits = SLZ_HASH_BITS_MAX;
+
+	return (sizeof(union ref) << hbits) + (level >= 2 ? sizeof(struct slz_dyn) : 0);
+}
+
 /* Initializes stream <strm> for use with raw deflate (rfc1951). The CRC is
  * unused but set to zero. The compression level passed in <level> is set. This
- * value can only be 0 (no compression) or 1 (compression) and other values
- * will lead to unpredictable behaviour. The function always returns 0.
+ * value can only be 0 (no compression) to 3 (best compression), as described
+ * in slz_init(), and other values will lead to unpredictable behaviour. The
+ * function always returns 0.
  */
 int slz_rfc1951_init(struct slz_stream *strm, int level)
 {
@@ -892,6 +2288,12 @@ int slz_rfc1951_init(struct slz_stream *strm, int level)
 	strm->ilen  = 0;
 	strm->qbits = 0;
 	strm->queue = 0;
+	strm->lazy  = 0;
+	strm->hbits = HASH_BITS;
+	strm->incomp = 0;
+	strm->noscan = 1;
+	strm->fast = 0;
+	strm->btype = 0;
 	return 0;
 }
 
@@ -922,6 +2324,24 @@ int slz_rfc1951_finish(struct slz_stream *strm, unsigned char *buf)
 	return strm->outbuf - buf;
 }
 
+/* Flushes pending bits for stream <strm> into buffer <buf> so that the receiver
+ * may decode all the data passed so far, and lets the stream continue. The
+ * current block is closed if any and followed by an empty stored block, which
+ * ends on a byte boundary, just like zlib's Z_SYNC_FLUSH. It returns the number
+ * of bytes emitted, which is at most 6, that the caller must ensure are
+ * available before calling the function. Nothing is emitted once the last block
+ * was started, slz_rfc1951_finish() has to be used then.
+ */
+int slz_rfc1951_flush(struct slz_stream *strm, unsigned char *buf)
+{
+	if (strm->state == SLZ_ST_LAST || strm->state >= SLZ_ST_DONE)
+		return 0;
+
+	strm->outbuf = buf;
+	send_empty_stored(strm);
+	return strm->outbuf - buf;
+}
+
 /* not thread-safe, must be called exactly once */
 void slz_prepare_dist_table()
 {
@@ -929,6 +2349,9 @@ void slz_prepare_dist_table()
 	uint32_t code;
 	uint32_t bits;
 
+	if (kern_cpu < 0)
+		slz_set_cpu(-1);
+
 	for (dist = 0; dist < sizeof(fh_dist_table) / sizeof(*fh_dist_table); dist++) {
 		code = dist_to_code(dist + 1);
 		bits = code >> 1;
@@ -1076,6 +2499,9 @@ void slz_make_crc_table(void)
 	uint32_t c;
 	int n, k;
 
+	if (kern_cpu < 0)
+		slz_set_cpu(-1);
+
 	for (n = 0; n < 256; n++) {
 		c = (uint32_t) n ^ 255;
 		for (k = 0; k < 8; k++) {
@@ -1094,11 +2520,9 @@ void slz_make_crc_table(void)
 	 * results in having the next 8 bits shifted in turn. That's why we
 	 * have the xor in the index used just after a computation.
 	 */
-	for (n = 0; n < 256; n++) {
-		crc32_fast[1][n] = 0xff000000 ^ crc32_fast[0][(0xff000000 ^ crc32_fast[0][n] ^ 0xff) & 0xff] ^ (crc32_fast[0][n] >> 8);
-		crc32_fast[2][n] = 0xff000000 ^ crc32_fast[0][(0x00ff0000 ^ crc32_fast[1][n] ^ 0xff) & 0xff] ^ (crc32_fast[1][n] >> 8);
-		crc32_fast[3][n] = 0xff000000 ^ crc32_fast[0][(0x0000ff00 ^ crc32_fast[2][n] ^ 0xff) & 0xff] ^ (crc32_fast[2][n] >> 8);
-	}
+	for (k = 1; k < 16; k++)
+		for (n = 0; n < 256; n++)
+			crc32_fast[k][n] = 0xff000000 ^ crc32_fast[0][(crc32_fast[k - 1][n] ^ 0xff) & 0xff] ^ (crc32_fast[k - 1][n] >> 8);
 }
 
 static inline uint32_t crc32_char(uint32_t crc, uint8_t x)
@@ -1202,10 +2626,292 @@ uint32_t slz_crc32_by4(uint32_t crc, const unsigned char *buf, int len)
 	return crc;
 }
 
-/* uses the most suitable crc32 function to update crc on <buf, len> */
+/* reads a 32-bit little endian word from <buf> */
+static inline uint32_t crc32_word(const unsigned char *buf)
+{
+#ifdef UNALIGNED_LE_OK
+	return *(uint32_t *)buf;
+#else
+	return buf[0] + (buf[1] << 8) + (buf[2] << 16) + ((uint32_t)buf[3] << 24);
+#endif
+}
+
+/* This version computes the crc32 of <buf> over <len> bytes, processing 8
+ * bytes at once using 8 tables ("slicing-by-8"). This breaks the dependency
+ * between consecutive lookups, which is about 60% faster than slz_crc32_by4()
+ * on modern CPUs, at the expense of a 8 kB table.
+ */
+uint32_t slz_crc32_by8(uint32_t crc, const unsigned char *buf, int len)
+{
+	const unsigned char *end = buf + len;
+	uint32_t w1;
+
+	while (buf <= end - 8) {
+		crc ^= crc32_word(buf);
+		w1   = crc32_word(buf + 4);
+		crc = crc32_fast[7][(crc >>  0) & 0xff] ^
+		      crc32_fast[6][(crc >>  8) & 0xff] ^
+		      crc32_fast[5][(crc >> 16) & 0xff] ^
+		      crc32_fast[4][(crc >> 24) & 0xff] ^
+		      crc32_fast[3][(w1  >>  0) & 0xff] ^
+		      crc32_fast[2][(w1  >>  8) & 0xff] ^
+		      crc32_fast[1][(w1  >> 16) & 0xff] ^
+		      crc32_fast[0][(w1  >> 24) & 0xff];
+		buf += 8;
+	}
+	return slz_crc32_by4(crc, buf, end - buf);
+}
+
+/* Same as slz_crc32_by8() with 16 bytes at once and 16 tables (16 kB). */
+uint32_t slz_crc32_by16(uint32_t crc, const unsigned char *buf, int len)
+{
+	const unsigned char *end = buf + len;
+	uint32_t w1, w2, w3;
+
+	while (buf <= end - 16) {
+		crc ^= crc32_word(buf);
+		w1   = crc32_word(buf + 4);
+		w2   = crc32_word(buf + 8);
+		w3   = crc32_word(buf + 12);
+		crc = crc32_fast[15][(crc >>  0) & 0xff] ^
+		      crc32_fast[14][(crc >>  8) & 0xff] ^
+		      crc32_fast[13][(crc >> 16) & 0xff] ^
+		      crc32_fast[12][(crc >> 24) & 0xff] ^
+		      crc32_fast[11][(w1  >>  0) & 0xff] ^
+		      crc32_fast[10][(w1  >>  8) & 0xff] ^
+		      crc32_fast[9][(w1   >> 16) & 0xff] ^
+		      crc32_fast[8][(w1   >> 24) & 0xff] ^
+		      crc32_fast[7][(w2   >>  0) & 0xff] ^
+		      crc32_fast[6][(w2   >>  8) & 0xff] ^
+		      crc32_fast[5][(w2   >> 16) & 0xff] ^
+		      crc32_fast[4][(w2   >> 24) & 0xff] ^
+		      crc32_fast[3][(w3   >>  0) & 0xff] ^
+		      crc32_fast[2][(w3   >>  8) & 0xff] ^
+		      crc32_fast[1][(w3   >> 16) & 0xff] ^
+		      crc32_fast[0][(w3   >> 24) & 0xff];
+		buf += 16;
+	}
+	return slz_crc32_by4(crc, buf, end - buf);
+}
+
+#if defined(HAVE_CLMUL)
+/* Folds the 4 128-bit accumulators <x1..x4> 64 bytes at a time with the <len>
+ * next bytes of <buf>, where <len> is a multiple of 16, then reduces them to
+ * the crc32 of the data, and finally processes the <rem> trailing bytes using
+ * the tables. This is the common part of crc32_clmul() and crc32_vclmul().
+ */
+static inline __attribute__((always_inline)) TARGET("pclmul,sse4.1")
+uint32_t crc32_clmul_fold(__m128i x1, __m128i x2, __m128i x3, __m128i x4,
+                          const unsigned char *buf, long len, long rem)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4); // x^480, x^544
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0); // x^96, x^160
+	const __m128i k5k0 = _mm_set_epi64x(0,           0x163cd6124); // x^64
+	const __m128i poly = _mm_set_epi64x(0x1f7011641, 0x1db710641); // mu, P
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x5, x6, x7, x8;
+	uint32_t crc;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf +  0)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 16)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 32)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 48)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* fold into 128 bits */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	/* fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	crc = ~(uint32_t)_mm_extract_epi32(x1, 1);
+	if (rem)
+		crc = slz_crc32_by16(crc, buf, rem);
+	return crc;
+}
+
+/* Computes the crc32 of <buf> over <len> bytes using carry-less
+ * multiplications, as described in Intel's paper "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction". The data are folded 64
+ * bytes at a time into 4 128-bit accumulators by multiplying them by
+ * x^(512+-32) mod P, then these are folded into a single one, which is finally
+ * reduced to 32 bits using a Barrett reduction. The constants are bit-reflected
+ * and shifted by one bit. The trailing 0 to 15 bytes, as well as inputs shorter
+ * than 64 bytes, are processed by the tables. This is about 5 times as fast as
+ * slz_crc32_by16() on 32 kB.
+ */
+static TARGET("pclmul,sse4.1")
+uint32_t crc32_clmul(uint32_t crc, const unsigned char *buf, int len)
+{
+	__m128i x1, x2, x3, x4;
+	long rem = len & 15;
+
+	if (len < 64)
+		return slz_crc32_by16(crc, buf, len);
+
+	x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + 0)), _mm_cvtsi32_si128(~crc));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 32));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 48));
+	return crc32_clmul_fold(x1, x2, x3, x4, buf + 64, len - rem - 64, rem);
+}
+#endif
+
+#if defined(HAVE_VPCLMUL)
+/* Same as crc32_clmul() except that inputs of 256 bytes or more are first
+ * folded 128 bytes at a time in 256-bit registers using VPCLMULQDQ, which is
+ * about twice as fast.
+ */
+static TARGET("vpclmulqdq,avx2,pclmul,sse4.1")
+uint32_t crc32_vclmul(uint32_t crc, const unsigned char *buf, int len)
+{
+	const __m256i k1024 = _mm256_set_epi64x(0x14a7fe880, 0x1e88ef372, 0x14a7fe880, 0x1e88ef372); // x^992, x^1056
+	const __m256i k512  = _mm256_set_epi64x(0x1c6e41596, 0x154442bd4, 0x1c6e41596, 0x154442bd4);
+	__m256i y1, y2, y3, y4, y5, y6, y7, y8;
+	long rem = len & 15;
+
+	if (len < 256)
+		return crc32_clmul(crc, buf, len);
+
+	len -= rem;
+	y1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf +  0)), _mm256_setr_epi32(~crc, 0, 0, 0, 0, 0, 0, 0));
+	y2 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+	y3 = _mm256_loadu_si256((const __m256i *)(buf + 64));
+	y4 = _mm256_loadu_si256((const __m256i *)(buf + 96));
+	buf += 128;
+	len -= 128;
+
+	while (len >= 128) {
+		y5 = _mm256_clmulepi64_epi128(y1, k1024, 0x00);
+		y6 = _mm256_clmulepi64_epi128(y2, k1024, 0x00);
+		y7 = _mm256_clmulepi64_epi128(y3, k1024, 0x00);
+		y8 = _mm256_clmulepi64_epi128(y4, k1024, 0x00);
+		y1 = _mm256_clmulepi64_epi128(y1, k1024, 0x11);
+		y2 = _mm256_clmulepi64_epi128(y2, k1024, 0x11);
+		y3 = _mm256_clmulepi64_epi128(y3, k1024, 0x11);
+		y4 = _mm256_clmulepi64_epi128(y4, k1024, 0x11);
+		y1 = _mm256_xor_si256(_mm256_xor_si256(y1, y5), _mm256_loadu_si256((const __m256i *)(buf +  0)));
+		y2 = _mm256_xor_si256(_mm256_xor_si256(y2, y6), _mm256_loadu_si256((const __m256i *)(buf + 32)));
+		y3 = _mm256_xor_si256(_mm256_xor_si256(y3, y7), _mm256_loadu_si256((const __m256i *)(buf + 64)));
+		y4 = _mm256_xor_si256(_mm256_xor_si256(y4, y8), _mm256_loadu_si256((const __m256i *)(buf + 96)));
+		buf += 128;
+		len -= 128;
+	}
+
+	/* fold the first 64 bytes into the last 64 ones */
+	y5 = _mm256_clmulepi64_epi128(y1, k512, 0x00);
+	y6 = _mm256_clmulepi64_epi128(y2, k512, 0x00);
+	y1 = _mm256_clmulepi64_epi128(y1, k512, 0x11);
+	y2 = _mm256_clmulepi64_epi128(y2, k512, 0x11);
+	y3 = _mm256_xor_si256(_mm256_xor_si256(y3, y1), y5);
+	y4 = _mm256_xor_si256(_mm256_xor_si256(y4, y2), y6);
+
+	return crc32_clmul_fold(_mm256_castsi256_si128(y3), _mm256_extracti128_si256(y3, 1),
+	                        _mm256_castsi256_si128(y4), _mm256_extracti128_si256(y4, 1),
+	                        buf, len, rem);
+}
+#endif
+
+/* uses the crc32 function selected for the CPU to update crc on <buf, len> */
 static inline uint32_t update_crc(uint32_t crc, const void *buf, int len)
 {
-	return slz_crc32_by4(crc, buf, len);
+	return kern.crc32(crc, buf, len);
+}
+
+/* Returns <a> * <b> modulo the CRC32 polynomial, both being polynomials in the
+ * reflected bit order used by the CRC (x^0 is the highest bit). <a> must not
+ * be zero.
+ */
+static uint32_t crc32_mult(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31;
+	uint32_t p = 0;
+
+	while (1) {
+		if (a & m) {
+			p ^= b;
+			if (!(a & (m - 1)))
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+	return p;
+}
+
+/* Returns the CRC32 of the concatenation of two blocks, given <crc1>, the CRC
+ * of the first one, and <crc2> and <len2>, the CRC and length of the second
+ * one. This allows to compute CRCs of separate parts in parallel. Appending
+ * <len2> bytes multiplies the first CRC by x^(8*len2), which is obtained by
+ * multiplying the successive squares of x^8 for each bit set in <len2>. It
+ * takes about 1 microsecond.
+ */
+uint32_t slz_crc32_combine(uint32_t crc1, uint32_t crc2, unsigned long len2)
+{
+	uint32_t sq = 1U << 23; /* x^8 */
+	uint32_t p  = 1U << 31; /* x^0 */
+
+	for (; len2; len2 >>= 1) {
+		if (len2 & 1)
+			p = crc32_mult(sq, p);
+		sq = crc32_mult(sq, sq);
+	}
+	return crc32_mult(p, crc1) ^ crc2;
+}
+
+/* Updates <crc> with the <len> bytes from <buf> using the crc32 function
+ * selected for the CPU. The CRC of an empty buffer is 0.
+ */
+uint32_t slz_crc32(uint32_t crc, const unsigned char *buf, long len)
+{
+	int n;
+
+	while (len) {
+		n = len > (1 << 30) ? (1 << 30) : len;
+		crc = update_crc(crc, buf, n);
+		buf += n;
+		len -= n;
+	}
+	return crc;
 }
 
 /* Sends the gzip header for stream <strm> into buffer <buf>. When it's done,
@@ -1231,15 +2937,44 @@ long slz_rfc1952_encode(struct slz_stream *strm, unsigned char *out, const unsig
 	if (__builtin_expect(strm->state == SLZ_ST_INIT, 0))
 		ret += slz_rfc1952_send_header(strm, out);
 
-	strm->crc32 = update_crc(strm->crc32, in, ilen);
-	ret += slz_rfc1951_encode(strm, out + ret, in, ilen, more);
+	ret += rfc1951_encode_hist_ck(strm, out + ret, in, ilen, more, NULL, 0, 1);
+	return ret;
+}
+
+/* Same as slz_rfc1952_encode() with a history window, see
+ * slz_rfc1951_encode_hist() for the details.
+ */
+long slz_rfc1952_encode_hist(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                             const unsigned char *hist, long hlen)
+{
+	long ret = 0;
+
+	if (__builtin_expect(strm->state == SLZ_ST_INIT, 0))
+		ret += slz_rfc1952_send_header(strm, out);
+
+	ret += rfc1951_encode_hist_ck(strm, out + ret, in, ilen, more, hist, hlen, 1);
+	return ret;
+}
+
+/* Same as slz_rfc1952_encode_hist() using workspace <ws>, see
+ * slz_rfc1951_encode_ws() for the details.
+ */
+long slz_rfc1952_encode_ws(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                           const unsigned char *hist, long hlen, void *ws)
+{
+	long ret = 0;
+
+	if (__builtin_expect(strm->state == SLZ_ST_INIT, 0))
+		ret += slz_rfc1952_send_header(strm, out);
+
+	ret += rfc1951_encode_ws_ck(strm, out + ret, in, ilen, more, hist, hlen, ws, 1);
 	return ret;
 }
 
 /* Initializes stream <strm> for use with the gzip format (rfc1952). The
  * compression level passed in <level> is set. This value can only be 0 (no
- * compression) or 1 (compression) and other values will lead to unpredictable
- * behaviour. The function always returns 0.
+ * compression) to 3 (best compression), as described in slz_init(), and other
+ * values will lead to unpredictable behaviour. The function always returns 0.
  */
 int slz_rfc1952_init(struct slz_stream *strm, int level)
 {
@@ -1250,9 +2985,28 @@ int slz_rfc1952_init(struct slz_stream *strm, int level)
 	strm->ilen   = 0;
 	strm->qbits  = 0;
 	strm->queue  = 0;
+	strm->lazy   = 0;
+	strm->hbits  = HASH_BITS;
+	strm->incomp = 0;
+	strm->noscan = 1;
+	strm->fast = 0;
+	strm->btype = 0;
 	return 0;
 }
 
+/* Same as slz_rfc1951_flush() except that the gzip header is sent first if it
+ * was not sent yet, which may amount to 16 bytes.
+ */
+int slz_rfc1952_flush(struct slz_stream *strm, unsigned char *buf)
+{
+	int ret = 0;
+
+	if (__builtin_expect(strm->state == SLZ_ST_INIT, 0))
+		ret += slz_rfc1952_send_header(strm, buf);
+
+	return ret + slz_rfc1951_flush(strm, buf + ret);
+}
+
 /* Flushes pending bits and sends the gzip trailer for stream <strm> into
  * buffer <buf>. When it's done, the stream state is updated to SLZ_ST_END. It
  * returns the number of bytes emitted. The trailer consists in flushing the
@@ -1446,7 +3200,7 @@ uint32_t slz_adler32_block(uint32_t crc, const unsigned char *buf, long len)
 		 * have to take care of the values between 65521 and 65536.
 		 */
 		s1 = (s1 & 0xffff) + 15 * (s1 >> 16);
-		if (s1 > 65521)
+		if (s1 >= 65521)
 			s1 -= 65521;
 
 		/* For s2, the largest value is estimated to 2^32-1 for
@@ -1455,7 +3209,7 @@ uint32_t slz_adler32_block(uint32_t crc, const unsigned char *buf, long len)
 		 */
 		s2 = (s2 & 0xffff) + 15 * (s2 >> 16);
 		s2 = (s2 & 0xffff) + 15 * (s2 >> 16);
-		if (s2 > 65521)
+		if (s2 >= 65521)
 			s2 -= 65521;
 
 		buf += blk;
@@ -1463,6 +3217,204 @@ uint32_t slz_adler32_block(uint32_t crc, const unsigned char *buf, long len)
 	return (s2 << 16) + s1;
 }
 
+#if defined(__SSE2__)
+/* Returns the sum of the 4 32-bit words of <x> */
+static inline uint32_t hsum_epi32(__m128i x)
+{
+	x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+	x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtsi128_si32(x);
+}
+
+/* Computes the adler32 sum on <buf> for <len> bytes using vector instructions.
+ * For a block of N bytes, s1 is increased by the sum of the bytes and s2 by N
+ * times the initial s1 plus the sum of each byte multiplied by its distance to
+ * the end of the block (N for the first one, 1 for the last one). The sums of
+ * bytes are computed by PSADBW, and the weighted sums by multiplying bytes
+ * extended to 16 bits by a vector of weights and adding adjacent products
+ * (PMADDWD), 32 bytes at a time. The sums of s1 at the beginning of each block
+ * are accumulated to be multiplied by N at the end. The modulus is only applied
+ * every 5536 bytes, which is the largest multiple of 32 below 5552, the largest
+ * length for which s2 cannot overflow 32 bits. The trailing bytes are
+ * processed by slz_adler32_block(). On 32 kB this is about 14 times as fast as
+ * the latter.
+ */
+static uint32_t adler32_sse2(uint32_t crc, const unsigned char *buf, long len)
+{
+	const __m128i tap1 = _mm_setr_epi16(32, 31, 30, 29, 28, 27, 26, 25);
+	const __m128i tap2 = _mm_setr_epi16(24, 23, 22, 21, 20, 19, 18, 17);
+	const __m128i tap3 = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10,  9);
+	const __m128i tap4 = _mm_setr_epi16( 8,  7,  6,  5,  4,  3,  2,  1);
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t s1 = (crc & 0xffff) % 65521;
+	uint32_t s2 = (crc >> 16) % 65521;
+	__m128i v_s1, v_s2, v_ps, b1, b2;
+	long n;
+
+	while (len >= 32) {
+		n = len < 5536 ? len / 32 : 5536 / 32;
+		len -= n * 32;
+
+		v_ps = _mm_cvtsi32_si128(s1 * n);
+		v_s2 = _mm_cvtsi32_si128(s2);
+		v_s1 = zero;
+
+		do {
+			b1 = _mm_loadu_si128((const __m128i *)buf);
+			b2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+			v_ps = _mm_add_epi32(v_ps, v_s1);
+			v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b1, zero));
+			v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b2, zero));
+			v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(b1, zero), tap1));
+			v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(b1, zero), tap2));
+			v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(b2, zero), tap3));
+			v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(b2, zero), tap4));
+			buf += 32;
+		} while (--n);
+
+		v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+		s1 = (s1 + hsum_epi32(v_s1)) % 65521;
+		s2 = hsum_epi32(v_s2) % 65521;
+	}
+
+	crc = (s2 << 16) + s1;
+	if (len)
+		crc = slz_adler32_block(crc, buf, len);
+	return crc;
+}
+#endif
+
+#if defined(HAVE_SSSE3)
+/* Same as adler32_sse2() except that the weighted sums are computed directly
+ * on bytes using PMADDUBSW, which is about 20% faster.
+ */
+static TARGET("ssse3")
+uint32_t adler32_ssse3(uint32_t crc, const unsigned char *buf, long len)
+{
+	const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+	const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1);
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t s1 = (crc & 0xffff) % 65521;
+	uint32_t s2 = (crc >> 16) % 65521;
+	__m128i v_s1, v_s2, v_ps, b1, b2;
+	long n;
+
+	while (len >= 32) {
+		n = len < 5536 ? len / 32 : 5536 / 32;
+		len -= n * 32;
+
+		v_ps = _mm_cvtsi32_si128(s1 * n);
+		v_s2 = _mm_cvtsi32_si128(s2);
+		v_s1 = zero;
+
+		do {
+			b1 = _mm_loadu_si128((const __m128i *)buf);
+			b2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+			v_ps = _mm_add_epi32(v_ps, v_s1);
+			v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b1, zero));
+			v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b2, zero));
+			v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+			v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+			buf += 32;
+		} while (--n);
+
+		v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+		s1 = (s1 + hsum_epi32(v_s1)) % 65521;
+		s2 = hsum_epi32(v_s2) % 65521;
+	}
+
+	crc = (s2 << 16) + s1;
+	if (len)
+		crc = slz_adler32_block(crc, buf, len);
+	return crc;
+}
+#endif
+
+#if defined(HAVE_AVX2)
+/* Same as adler32_ssse3() except that 64 bytes are processed at a time in
+ * 256-bit registers, and the modulus is applied every 5504 bytes, which is the
+ * largest multiple of 64 below 5552. This is about 70% faster.
+ */
+static TARGET("avx2")
+uint32_t adler32_avx2(uint32_t crc, const unsigned char *buf, long len)
+{
+	const __m256i tap1 = _mm256_setr_epi8(64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+	                                      48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33);
+	const __m256i tap2 = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+	                                      16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1);
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t s1 = (crc & 0xffff) % 65521;
+	uint32_t s2 = (crc >> 16) % 65521;
+	__m256i v_s1, v_s2, v_ps, b1, b2;
+	long n;
+
+	while (len >= 64) {
+		n = len < 5504 ? len / 64 : 5504 / 64;
+		len -= n * 64;
+
+		v_ps = _mm256_setr_epi32(s1 * n, 0, 0, 0, 0, 0, 0, 0);
+		v_s2 = _mm256_setr_epi32(s2, 0, 0, 0, 0, 0, 0, 0);
+		v_s1 = zero;
+
+		do {
+			b1 = _mm256_loadu_si256((const __m256i *)buf);
+			b2 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+			v_ps = _mm256_add_epi32(v_ps, v_s1);
+			v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(b1, zero));
+			v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(b2, zero));
+			v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(b1, tap1), ones));
+			v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(b2, tap2), ones));
+			buf += 64;
+		} while (--n);
+
+		v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 6));
+		s1 = (s1 + hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1)))) % 65521;
+		s2 = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1))) % 65521;
+	}
+
+	crc = (s2 << 16) + s1;
+	if (len)
+		crc = slz_adler32_block(crc, buf, len);
+	return crc;
+}
+#endif
+
+/* uses the adler32 function selected for the CPU to update <crc> on <buf, len> */
+static inline uint32_t update_adler(uint32_t crc, const unsigned char *buf, long len)
+{
+	return kern.adler32(crc, buf, len);
+}
+
+/* Returns the adler32 sum of the concatenation of two blocks, given <adl1>,
+ * the sum of the first one, and <adl2> and <len2>, the sum and length of the
+ * second one. Since s1 of the second block started at 1 instead of the first
+ * block's s1, the latter minus one has to be added to s1, and <len2> times to
+ * s2.
+ */
+uint32_t slz_adler32_combine(uint32_t adl1, uint32_t adl2, unsigned long len2)
+{
+	uint32_t s1a = (adl1 & 0xffff) % 65521;
+	uint32_t s2a = (adl1 >> 16) % 65521;
+	uint32_t s1b = (adl2 & 0xffff) % 65521;
+	uint32_t s2b = (adl2 >> 16) % 65521;
+	uint32_t rem = len2 % 65521;
+	uint32_t s1, s2;
+
+	s1 = (s1a + s1b + 65521 - 1) % 65521;
+	s2 = (uint32_t)(((uint64_t)rem * s1a + s2a + s2b + 65521 - rem) % 65521);
+	return (s2 << 16) + s1;
+}
+
+/* Updates <crc> with the <len> bytes from <buf> using the adler32 function
+ * selected for the CPU. The sum of an empty buffer is 1.
+ */
+uint32_t slz_adler32(uint32_t crc, const unsigned char *buf, long len)
+{
+	return update_adler(crc, buf, len);
+}
+
 /* Sends the zlib header for stream <strm> into buffer <buf>. When it's done,
  * the stream state is updated to SLZ_ST_EOB. It returns the number of bytes
  * emitted which is always 2. The caller is responsible for ensuring there's
@@ -1486,15 +3438,44 @@ long slz_rfc1950_encode(struct slz_stream *strm, unsigned char *out, const unsig
 	if (__builtin_expect(strm->state == SLZ_ST_INIT, 0))
 		ret += slz_rfc1950_send_header(strm, out);
 
-	strm->crc32 = slz_adler32_block(strm->crc32, in, ilen);
-	ret += slz_rfc1951_encode(strm, out + ret, in, ilen, more);
+	ret += rfc1951_encode_hist_ck(strm, out + ret, in, ilen, more, NULL, 0, 1);
+	return ret;
+}
+
+/* Same as slz_rfc1950_encode() with a history window, see
+ * slz_rfc1951_encode_hist() for the details.
+ */
+long slz_rfc1950_encode_hist(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                             const unsigned char *hist, long hlen)
+{
+	long ret = 0;
+
+	if (__builtin_expect(strm->state == SLZ_ST_INIT, 0))
+		ret += slz_rfc1950_send_header(strm, out);
+
+	ret += rfc1951_encode_hist_ck(strm, out + ret, in, ilen, more, hist, hlen, 1);
+	return ret;
+}
+
+/* Same as slz_rfc1950_encode_hist() using workspace <ws>, see
+ * slz_rfc1951_encode_ws() for the details.
+ */
+long slz_rfc1950_encode_ws(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more,
+                           const unsigned char *hist, long hlen, void *ws)
+{
+	long ret = 0;
+
+	if (__builtin_expect(strm->state == SLZ_ST_INIT, 0))
+		ret += slz_rfc1950_send_header(strm, out);
+
+	ret += rfc1951_encode_ws_ck(strm, out + ret, in, ilen, more, hist, hlen, ws, 1);
 	return ret;
 }
 
 /* Initializes stream <strm> for use with the zlib format (rfc1952). The
  * compression level passed in <level> is set. This value can only be 0 (no
- * compression) or 1 (compression) and other values will lead to unpredictable
- * behaviour. The function always returns 0.
+ * compression) to 3 (best compression), as described in slz_init(), and other
+ * values will lead to unpredictable behaviour. The function always returns 0.
  */
 int slz_rfc1950_init(struct slz_stream *strm, int level)
 {
@@ -1505,9 +3486,28 @@ int slz_rfc1950_init(struct slz_stream *strm, int level)
 	strm->ilen   = 0;
 	strm->qbits  = 0;
 	strm->queue  = 0;
+	strm->lazy   = 0;
+	strm->hbits  = HASH_BITS;
+	strm->incomp = 0;
+	strm->noscan = 1;
+	strm->fast = 0;
+	strm->btype = 0;
 	return 0;
 }
 
+/* Same as slz_rfc1951_flush() except that the zlib header is sent first if it
+ * was not sent yet, which may amount to 8 bytes.
+ */
+int slz_rfc1950_flush(struct slz_stream *strm, unsigned char *buf)
+{
+	int ret = 0;
+
+	if (__builtin_expect(strm->state == SLZ_ST_INIT, 0))
+		ret += slz_rfc1950_send_header(strm, buf);
+
+	return ret + slz_rfc1951_flush(strm, buf + ret);
+}
+
 /* Flushes pending bits and sends the gzip trailer for stream <strm> into
  * buffer <buf>. When it's done, the stream state is updated to SLZ_ST_END. It
  * returns the number of bytes emitted. The trailer consists in flushing the
@@ -1522,7 +3522,7 @@ int slz_rfc1950_finish(struct slz_stream *strm, unsigned char *buf)
 	strm->outbuf = buf;
 
 	if (__builtin_expect(strm->state == SLZ_ST_INIT, 0))
-		strm->outbuf += slz_rfc1952_send_header(strm, strm->outbuf);
+		strm->outbuf += slz_rfc1950_send_header(strm, strm->outbuf);
 
 	slz_rfc1951_finish(strm, strm->outbuf);
 	copy_8b(strm, (strm->crc32 >> 24) & 0xff);
@@ -1532,3 +3532,410 @@ int slz_rfc1950_finish(struct slz_stream *strm, unsigned char *buf)
 	strm->state = SLZ_ST_END;
 	return strm->outbuf - buf;
 }
+
+
+/* Parallel encoding. The input is split into segments which are compressed by
+ * independent threads as raw deflate data, each of them but the last one being
+ * terminated by an empty stored block so that it ends on a byte boundary. This
+ * way they only have to be concatenated, and the checksums of the segments are
+ * merged. Since nothing is shared between calls on a stream, it produces valid
+ * output, only missing the matches crossing segment boundaries.
+ */
+struct slz_mt_seg {
+	struct slz_stream strm;
+	pthread_t thr;
+	const unsigned char *in;
+	unsigned char *out;
+	long ilen;
+	long olen;
+	int more;           /* more data follow in the stream */
+	int align;          /* not the last segment, must end byte-aligned */
+	int started;        /* a thread was created */
+#ifdef SLZ_STATS
+	struct slz_stats stats; /* statistics of the dedicated thread */
+#endif
+};
+
+/* compresses the segment described by <arg>, see slz_encode_mt() */
+static void *mt_encode_seg(void *arg)
+{
+	struct slz_mt_seg *seg = arg;
+
+	seg->strm.crc32 = (seg->strm.format == SLZ_FMT_ZLIB);
+	seg->olen = rfc1951_encode_hist_ck(&seg->strm, seg->out, seg->in, seg->ilen, seg->more, NULL, 0, 1);
+	if (seg->align) {
+		seg->strm.outbuf = seg->out + seg->olen;
+		send_empty_stored(&seg->strm);
+		seg->olen = seg->strm.outbuf - seg->out;
+	}
+#ifdef SLZ_STATS
+	/* only merged by the caller if this is a dedicated thread */
+	seg->stats = thread_stats;
+#endif
+	return NULL;
+}
+
+/* Same as slz_encode() except that the input is split into up to <nthreads>
+ * segments of at least SLZ_MT_MIN_SEG bytes, all of them but the first one
+ * being compressed by a dedicated thread while the calling thread compresses
+ * the first one. The output is the same as if each segment had been passed to
+ * slz_encode() followed by an empty stored block, so the output buffer must
+ * have 6 extra bytes per thread. The stream's settings (level, lazy matching,
+ * fast mode, hash bits) apply to all segments, and the stream continues after
+ * the last one. The extra threads need a temporary output buffer of about 9/8
+ * of their input. If it cannot be allocated, or if the input is too small for
+ * two segments, everything is done in the calling thread. If a thread cannot
+ * be created, its segment is compressed by the calling thread as well. The
+ * number of output bytes is returned.
+ */
+long slz_encode_mt(struct slz_stream *strm, void *out, const void *in, long ilen, int more, int nthreads)
+{
+	const unsigned char *src = in;
+	unsigned char *dst = out;
+	unsigned char *tmp;
+	long seglen, ofs, tmplen, ret;
+	int n, i;
+
+	n = nthreads < SLZ_MT_MAX ? nthreads : SLZ_MT_MAX;
+	if (n > ilen / SLZ_MT_MIN_SEG)
+		n = ilen / SLZ_MT_MIN_SEG;
+
+	seglen = n > 1 ? (ilen + n - 1) / n : ilen;
+	tmplen = slz_bound(seglen) + 6;
+	tmp = n > 1 ? malloc(tmplen * (n - 1)) : NULL;
+	if (!tmp)
+		return slz_encode(strm, out, in, ilen, more);
+
+	{
+		struct slz_mt_seg segs[n];
+
+		/* segment 0 is done by the calling thread */
+		for (i = 1, ofs = seglen; i < n; i++, ofs += seglen) {
+			segs[i].strm  = *strm;
+			segs[i].strm.state = SLZ_ST_EOB;
+			segs[i].strm.queue = 0;
+			segs[i].strm.qbits = 0;
+			/* not a stream start, skips the magic number check */
+			segs[i].strm.ilen  = strm->ilen + ofs;
+			segs[i].in    = src + ofs;
+			segs[i].out   = tmp + (i - 1) * tmplen;
+			segs[i].ilen  = (i < n - 1) ? seglen : ilen - ofs;
+			segs[i].align = (i < n - 1);
+			segs[i].more  = segs[i].align || more;
+			segs[i].started = !pthread_create(&segs[i].thr, NULL, mt_encode_seg, &segs[i]);
+		}
+
+		ret = slz_encode(strm, dst, src, seglen, 1);
+		strm->outbuf = dst + ret;
+		send_empty_stored(strm);
+		ret = strm->outbuf - dst;
+
+		for (i = 1; i < n; i++) {
+			if (segs[i].started) {
+				pthread_join(segs[i].thr, NULL);
+#ifdef SLZ_STATS
+				thread_stats.matches        += segs[i].stats.matches;
+				thread_stats.match_len      += segs[i].stats.match_len;
+				thread_stats.lit_bytes      += segs[i].stats.lit_bytes;
+				thread_stats.stored_bytes   += segs[i].stats.stored_bytes;
+				thread_stats.huff_bytes     += segs[i].stats.huff_bytes;
+				thread_stats.block_switches += segs[i].stats.block_switches;
+				thread_stats.rejected_hits  += segs[i].stats.rejected_hits;
+#endif
+			}
+			else
+				mt_encode_seg(&segs[i]);
+
+			memcpy(dst + ret, segs[i].out, segs[i].olen);
+			ret += segs[i].olen;
+
+			if (strm->format == SLZ_FMT_GZIP)
+				strm->crc32 = slz_crc32_combine(strm->crc32, segs[i].strm.crc32, segs[i].ilen);
+			else if (strm->format == SLZ_FMT_ZLIB)
+				strm->crc32 = slz_adler32_combine(strm->crc32, segs[i].strm.crc32, segs[i].ilen);
+			strm->ilen += segs[i].ilen;
+		}
+
+		/* the stream continues where the last segment stopped */
+		strm->state  = segs[n - 1].strm.state;
+		strm->queue  = segs[n - 1].strm.queue;
+		strm->qbits  = segs[n - 1].strm.qbits;
+		strm->incomp = segs[n - 1].strm.incomp;
+	}
+
+	free(tmp);
+	return ret;
+}
+
+/* Same as slz_encode_hist() except that at most <osize> bytes are written to
+ * <out>, including the SLZ_OUT_SLACK bytes, so that the output may be sent
+ * directly from fixed-size buffers. The input is compressed by chunks as long
+ * as slz_bound() guarantees that the next chunk fits in the remaining space,
+ * the previous chunks serving as history (up to 16 times the chunk's size to
+ * limit the indexing cost of small chunks). The number of input bytes consumed
+ * is stored into <used>, and the number of output bytes is returned. The
+ * stream always stops between two chunks, so the remaining input may simply
+ * be passed to the next call, with the consumed input as history. A chunk is
+ * never shorter than SLZ_PARTIAL_MIN bytes unless it is the last one or the
+ * first one, so at least one byte is consumed if <osize> is at least
+ * slz_bound(1). When all the input is consumed, slz_finish() is guaranteed to
+ * fit into the remaining space.
+ */
+long slz_encode_partial(struct slz_stream *strm, void *out, long osize, const void *in, long ilen, int more,
+                        const void *hist, long hlen, long *used)
+{
+	const unsigned char *src = in;
+	unsigned char *dst = out;
+	long done = 0;
+	long ret = 0;
+	long len;
+
+	while (done < ilen) {
+		/* largest len such that slz_bound(len) <= osize - ret */
+		len = (osize - ret - slz_bound(0)) * 8 / 9;
+		if (len <= 0)
+			break;
+
+		if (len >= ilen - done)
+			len = ilen - done;
+		else if (len < SLZ_PARTIAL_MIN && done)
+			break;
+
+		if (done) {
+			/* limit the cost of indexing for small chunks */
+			hlen = done < 32768 ? done : 32768;
+			if (hlen > 16 * len)
+				hlen = 16 * len;
+			hist = src + done - hlen;
+		}
+
+		ret += slz_encode_hist(strm, dst + ret, src + done, len, more || done + len < ilen, hist, hlen);
+		done += len;
+	}
+
+	*used = done;
+	return ret;
+}
+
+/* Same as slz_encode() except that the input is made of the <iovcnt> segments
+ * described by <iov>, as when a response is stored in several buffers. Each
+ * segment is compressed and checksummed in place, the previous one serving as
+ * history so that matches may reference data across segment boundaries. Since
+ * each call has a fixed cost, consecutive segments shorter than SLZ_IOV_SMALL
+ * are first gathered into one of two stack buffers of SLZ_IOV_GATHER bytes,
+ * which alternate so that the previous one remains usable as history. The
+ * output buffer must be large enough for the sum of the segments' lengths, see
+ * slz_bound(). The number of output bytes is returned.
+ */
+long slz_encodev(struct slz_stream *strm, void *out, const struct iovec *iov, int iovcnt, int more)
+{
+	unsigned char gbuf[2][SLZ_IOV_GATHER];
+	const unsigned char *hist = NULL;
+	const unsigned char *seg;
+	unsigned char *dst = out;
+	long hlen = 0, glen = 0, len;
+	long ret = 0;
+	int last, i, g = 0;
+
+	/* only the last non-empty segment may end the stream */
+	for (last = iovcnt - 1; last >= 0 && !iov[last].iov_len; last--)
+		;
+
+	if (last < 0)
+		return slz_encode(strm, out, "", 0, more);
+
+	for (i = 0; i <= last; i++) {
+		seg = iov[i].iov_base;
+		len = iov[i].iov_len;
+		if (!len)
+			continue;
+
+		if (len < SLZ_IOV_SMALL && glen + len <= SLZ_IOV_GATHER) {
+			memcpy(gbuf[g] + glen, seg, len);
+			glen += len;
+			continue;
+		}
+
+		if (glen) {
+			/* send gathered segments first */
+			ret += slz_encode_hist(strm, dst + ret, gbuf[g], glen, 1, hist, hlen);
+			hist = gbuf[g];
+			hlen = glen;
+			g ^= 1;
+			glen = 0;
+		}
+
+		if (len < SLZ_IOV_SMALL) {
+			memcpy(gbuf[g], seg, len);
+			glen = len;
+			continue;
+		}
+
+		ret += slz_encode_hist(strm, dst + ret, seg, len, more || i < last, hist, hlen);
+		hist = seg;
+		hlen = len;
+	}
+
+	if (glen)
+		ret += slz_encode_hist(strm, dst + ret, gbuf[g], glen, more, hist, hlen);
+	return ret;
+}
+
+/* Copies into <stats> the encoder statistics of the calling thread, covering
+ * all the streams it compressed since the last reset, including the segments
+ * compressed by the threads of slz_encode_mt(). They are then reset if <reset>
+ * is not null. Threads only ever update their own statistics, so each thread
+ * has to call this to report its part. Returns 0, or -1 if the library was
+ * built without SLZ_STATS, in which case <stats> is zeroed.
+ */
+int slz_get_stats(struct slz_stats *stats, int reset)
+{
+#ifdef SLZ_STATS
+	*stats = thread_stats;
+	if (reset)
+		memset(&thread_stats, 0, sizeof(thread_stats));
+	return 0;
+#else
+	memset(stats, 0, sizeof(*stats));
+	return -1;
+#endif
+}
+
+/* Names of the sets of CPU-specific functions, indexed by SLZ_CPU_* */
+static const char *slz_cpu_names[SLZ_CPU_COUNT] = {
+	[SLZ_CPU_GENERIC] = "generic",
+	[SLZ_CPU_SSE2]    = "sse2",
+	[SLZ_CPU_SSSE3]   = "ssse3",
+	[SLZ_CPU_CLMUL]   = "clmul",
+	[SLZ_CPU_AVX2]    = "avx2",
+	[SLZ_CPU_VPCLMUL] = "vpclmul",
+};
+
+/* Returns the name of set <cpu>, or "unknown" if it does not exist */
+const char *slz_cpu_name(int cpu)
+{
+	if (cpu < 0 || cpu >= SLZ_CPU_COUNT)
+		return "unknown";
+	return slz_cpu_names[cpu];
+}
+
+/* Returns the set named <name>, or -1 if it does not exist */
+int slz_cpu_by_name(const char *name)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < SLZ_CPU_COUNT; cpu++)
+		if (strcmp(name, slz_cpu_names[cpu]) == 0)
+			return cpu;
+	return -1;
+}
+
+/* Returns the most capable set of functions supported by both the CPU and the
+ * build. On x86_64 the CPU is checked, otherwise only the instruction set
+ * extensions enabled at build time are considered.
+ */
+int slz_cpu_detect(void)
+{
+	int cpu = SLZ_CPU_GENERIC;
+
+#if defined(SLZ_DISPATCH)
+	__builtin_cpu_init();
+	cpu = SLZ_CPU_SSE2;
+	if (!__builtin_cpu_supports("ssse3"))
+		return cpu;
+	cpu = SLZ_CPU_SSSE3;
+	if (!__builtin_cpu_supports("sse4.1") || !__builtin_cpu_supports("pclmul"))
+		return cpu;
+	cpu = SLZ_CPU_CLMUL;
+	if (!__builtin_cpu_supports("avx2"))
+		return cpu;
+	cpu = SLZ_CPU_AVX2;
+	if (!__builtin_cpu_supports("vpclmulqdq"))
+		return cpu;
+	cpu = SLZ_CPU_VPCLMUL;
+#else
+#if defined(__SSE2__)
+	cpu = SLZ_CPU_SSE2;
+#endif
+#if defined(HAVE_SSSE3)
+	cpu = SLZ_CPU_SSSE3;
+#endif
+#if defined(HAVE_CLMUL)
+	cpu = SLZ_CPU_CLMUL;
+#endif
+#if defined(HAVE_AVX2)
+	cpu = SLZ_CPU_AVX2;
+#endif
+#if defined(HAVE_VPCLMUL)
+	cpu = SLZ_CPU_VPCLMUL;
+#endif
+#endif
+	return cpu;
+}
+
+/* Selects the checksum, match length and references reset functions of set
+ * <cpu> (one of SLZ_CPU_*), capped to the most capable set supported by the CPU
+ * and the build. A negative value selects the most capable one, or the one
+ * named in the SLZ_CPU environment variable if it is set. This is done once
+ * with a negative value by slz_make_crc_table() and slz_prepare_dist_table(),
+ * so it is only needed to force a specific set, eg: to test or benchmark it.
+ * It is not thread-safe and must not be called while encoding. The selected
+ * set is returned.
+ */
+int slz_set_cpu(int cpu)
+{
+	int best = slz_cpu_detect();
+	const char *env;
+
+	if (cpu < 0) {
+		env = getenv("SLZ_CPU");
+		cpu = env ? slz_cpu_by_name(env) : -1;
+		if (cpu < 0)
+			cpu = best;
+	}
+
+	if (cpu > best)
+		cpu = best;
+
+	kern.crc32      = slz_crc32_by16;
+	kern.adler32    = slz_adler32_block;
+	kern.memmatch   = memmatch_word;
+	kern.reset_refs = reset_refs;
+
+#if defined(__SSE2__)
+	if (cpu >= SLZ_CPU_SSE2) {
+		kern.adler32  = adler32_sse2;
+		kern.memmatch = memmatch_sse2;
+	}
+#endif
+#if defined(HAVE_SSSE3)
+	if (cpu >= SLZ_CPU_SSSE3)
+		kern.adler32 = adler32_ssse3;
+#endif
+#if defined(HAVE_CLMUL)
+	if (cpu >= SLZ_CPU_CLMUL)
+		kern.crc32 = crc32_clmul;
+#endif
+#if defined(HAVE_AVX2)
+	if (cpu >= SLZ_CPU_AVX2) {
+		kern.adler32    = adler32_avx2;
+		kern.memmatch   = memmatch_avx2;
+		kern.reset_refs = reset_refs_avx2;
+	}
+#endif
+#if defined(HAVE_VPCLMUL)
+	if (cpu >= SLZ_CPU_VPCLMUL)
+		kern.crc32 = crc32_vclmul;
+#endif
+
+	kern_cpu = cpu;
+	return cpu;
+}
+
+/* Returns the set of CPU-specific functions in use, or -1 if none was selected
+ * yet, in which case the generic ones are used.
+ */
+int slz_get_cpu(void)
+{
+	return kern_cpu;
+}
@@ -26,6 +26,7 @@
 #define _SLZ_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 /* We have two macros UNALIGNED_LE_OK and UNALIGNED_FASTER. The latter indicates
  * that using unaligned data is faster than a simple shift. On x86 32-bit at
@@ -45,8 +46,41 @@
 #define UNALIGNED_FASTER
 #endif
 
-/* Log2 of the size of the hash table used for the references table. */
+/* Number of bytes past the end of the output that the encoding functions may
+ * overwrite with unspecified contents, which must be accounted for in the
+ * output buffer size.
+ */
+#define SLZ_OUT_SLACK 8
+
+/* Inputs smaller than this are not sampled by slz_incompressible(), larger
+ * ones are sampled by regions of SLZ_INCOMP_REGION bytes.
+ */
+#define SLZ_INCOMP_MIN 1024
+#define SLZ_INCOMP_REGION 65536
+
+/* Minimum segment size and maximum number of threads for slz_encode_mt() */
+#define SLZ_MT_MIN_SEG (256 * 1024)
+#define SLZ_MT_MAX 256
+
+/* Log2 of the default size of the hash table used for the references table,
+ * and supported range for slz_init_ex().
+ */
 #define HASH_BITS 13
+#define SLZ_HASH_BITS_MIN 10
+#define SLZ_HASH_BITS_MAX 15
+
+/* Sets of CPU-specific functions, see slz_set_cpu(). Each set also uses the
+ * functions of the previous ones that it does not replace.
+ */
+enum slz_cpu {
+	SLZ_CPU_GENERIC, /* portable code only */
+	SLZ_CPU_SSE2,    /* SSE2 match length and Adler-32 (x86_64 baseline) */
+	SLZ_CPU_SSSE3,   /* SSSE3 Adler-32 */
+	SLZ_CPU_CLMUL,   /* SSE4.1 and PCLMULQDQ CRC32 */
+	SLZ_CPU_AVX2,    /* AVX2 match length, Adler-32 and references reset */
+	SLZ_CPU_VPCLMUL, /* AVX2 and VPCLMULQDQ CRC32 */
+	SLZ_CPU_COUNT    /* number of sets */
+};
 
 enum slz_state {
 	SLZ_ST_INIT,  /* stream initialized */
@@ -68,43 +102,143 @@ struct slz_stream {
 	uint32_t qbits; /* number of bits in queue, < 8 */
 	unsigned char *outbuf; /* set by encode() */
 	uint16_t state; /* one of slz_state */
-	uint8_t level:1; /* 0 = no compression, 1 = compression */
+	uint8_t level:2; /* 0 = no compression, 1..3 = compression level */
 	uint8_t format:2; /* SLZ_FMT_* */
-	uint8_t unused1; /* unused for now */
+	uint8_t lazy:2;   /* lazy matching depth, 0 = disabled */
+	uint8_t incomp:1; /* last input predicted incompressible and stored */
+	uint8_t noscan:1; /* 1 = do not check for incompressible input */
+	uint8_t hbits:4; /* log2 of the references table size */
+	uint8_t fast:1;  /* 1 = skip faster over regions without matches */
+	uint8_t btype:2; /* type of the last block + 1 (0 = none), for stats */
 	uint32_t crc32;
 	uint32_t ilen;
 };
 
+/* Encoder statistics, only collected when the library is built with SLZ_STATS
+ * defined. They are kept per thread, for all the streams it compresses, so
+ * that no atomic operation is needed, and are retrieved by slz_get_stats() in
+ * each thread. Input bytes are either literals or parts of matches.
+ */
+struct slz_stats {
+	uint64_t matches;        /* matches emitted */
+	uint64_t match_len;      /* sum of the lengths of the matches emitted */
+	uint64_t lit_bytes;      /* bytes emitted as literals, in any block type */
+	uint64_t stored_bytes;   /* literals sent in stored blocks */
+	uint64_t huff_bytes;     /* literals sent in fixed huffman blocks at level 1 */
+	uint64_t block_switches; /* blocks of another type than the previous one */
+	uint64_t rejected_hits;  /* looked up hash entries not holding the same word */
+};
+
+/* Number of entries of the decoding tables of the inflater for dynamic huffman
+ * blocks, which are made of a main table of 2^11 entries for literals/lengths
+ * and 2^8 entries for the distances, followed by second level tables for
+ * longer codes. These are the worst case sizes computed by zlib's "enough"
+ * program. Fixed huffman blocks use constant tables instead.
+ */
+#define SLZ_INF_LIT_SIZE  2342
+#define SLZ_INF_DIST_SIZE 402
+
+enum slz_inf_state {
+	SLZ_IS_HEADER,  /* gzip or zlib header expected */
+	SLZ_IS_EXTRA,   /* inside the gzip extra field */
+	SLZ_IS_NAME,    /* inside the gzip file name or comment */
+	SLZ_IS_BLOCK,   /* block header expected */
+	SLZ_IS_STORED,  /* inside a stored block */
+	SLZ_IS_FIXED,   /* inside a fixed huffman block */
+	SLZ_IS_HUFF,    /* inside a dynamic huffman block */
+	SLZ_IS_TRAILER, /* gzip or zlib trailer expected */
+	SLZ_IS_END,     /* end of stream reached and checked */
+	SLZ_IS_ERROR,   /* invalid stream, see <msg> */
+};
+
+/* Inflater state. It is about 44 kB large, mostly for the window and decoding
+ * tables, and is allocated by the caller, which may embed it anywhere. No
+ * other memory is used.
+ */
+struct slz_istream {
+	uint64_t queue;   /* pending input bits, LSB first */
+	uint32_t qbits;   /* number of bits in queue */
+	uint32_t left;    /* bytes left in a stored block or gzip extra field */
+	uint32_t crc32;   /* checksum of the output so far */
+	uint32_t olen;    /* output length so far, modulo 2^32 */
+	uint16_t wpos;    /* next write position in the window */
+	uint16_t wlen;    /* number of valid bytes in the window */
+	uint8_t state;    /* one of slz_inf_state */
+	uint8_t format;   /* SLZ_FMT_* */
+	uint8_t last;     /* BFINAL was set on the current block */
+	uint8_t flags;    /* gzip header flags not processed yet */
+	const char *msg;  /* reason of the error in state SLZ_IS_ERROR */
+	uint32_t lit[SLZ_INF_LIT_SIZE];   /* literal/length decoding table */
+	uint32_t dist[SLZ_INF_DIST_SIZE]; /* distance decoding table */
+	unsigned char window[32768];      /* last 32 kB of output */
+};
+
 /* Functions specific to rfc1951 (deflate) */
 void slz_prepare_dist_table();
 long slz_rfc1951_encode(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more);
+long slz_rfc1951_encode_hist(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more, const unsigned char *hist, long hlen);
+long slz_rfc1951_encode_ws(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more, const unsigned char *hist, long hlen, void *ws);
+long slz_workspace_size(int level, int hbits);
+int slz_incompressible(const unsigned char *in, long ilen, int start);
 int slz_rfc1951_init(struct slz_stream *strm, int level);
+int slz_rfc1951_flush(struct slz_stream *strm, unsigned char *buf);
 int slz_rfc1951_finish(struct slz_stream *strm, unsigned char *buf);
 
 /* Functions specific to rfc1952 (gzip) */
 void slz_make_crc_table(void);
 uint32_t slz_crc32_by1(uint32_t crc, const unsigned char *buf, int len);
 uint32_t slz_crc32_by4(uint32_t crc, const unsigned char *buf, int len);
+uint32_t slz_crc32_by8(uint32_t crc, const unsigned char *buf, int len);
+uint32_t slz_crc32_by16(uint32_t crc, const unsigned char *buf, int len);
+uint32_t slz_crc32_combine(uint32_t crc1, uint32_t crc2, unsigned long len2);
+uint32_t slz_crc32(uint32_t crc, const unsigned char *buf, long len);
 long slz_rfc1952_encode(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more);
+long slz_rfc1952_encode_hist(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more, const unsigned char *hist, long hlen);
+long slz_rfc1952_encode_ws(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more, const unsigned char *hist, long hlen, void *ws);
 int slz_rfc1952_send_header(struct slz_stream *strm, unsigned char *buf);
 int slz_rfc1952_init(struct slz_stream *strm, int level);
+int slz_rfc1952_flush(struct slz_stream *strm, unsigned char *buf);
 int slz_rfc1952_finish(struct slz_stream *strm, unsigned char *buf);
 
 /* Functions specific to rfc1950 (zlib) */
 uint32_t slz_adler32_by1(uint32_t crc, const unsigned char *buf, int len);
 uint32_t slz_adler32_block(uint32_t crc, const unsigned char *buf, long len);
+uint32_t slz_adler32_combine(uint32_t adl1, uint32_t adl2, unsigned long len2);
+uint32_t slz_adler32(uint32_t crc, const unsigned char *buf, long len);
 long slz_rfc1950_encode(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more);
+long slz_rfc1950_encode_hist(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more, const unsigned char *hist, long hlen);
+long slz_rfc1950_encode_ws(struct slz_stream *strm, unsigned char *out, const unsigned char *in, long ilen, int more, const unsigned char *hist, long hlen, void *ws);
 int slz_rfc1950_send_header(struct slz_stream *strm, unsigned char *buf);
 int slz_rfc1950_init(struct slz_stream *strm, int level);
+int slz_rfc1950_flush(struct slz_stream *strm, unsigned char *buf);
 int slz_rfc1950_finish(struct slz_stream *strm, unsigned char *buf);
 
 /* generic functions */
 
+int slz_cpu_detect(void);
+int slz_set_cpu(int cpu);
+int slz_get_cpu(void);
+const char *slz_cpu_name(int cpu);
+int slz_cpu_by_name(const char *name);
+
+long slz_encode_mt(struct slz_stream *strm, void *out, const void *in, long ilen, int more, int nthreads);
+long slz_encode_partial(struct slz_stream *strm, void *out, long osize, const void *in, long ilen, int more,
+                        const void *hist, long hlen, long *used);
+long slz_encodev(struct slz_stream *strm, void *out, const struct iovec *iov, int iovcnt, int more);
+int slz_get_stats(struct slz_stats *stats, int reset);
+
+/* Functions of the inflater */
+void slz_inflate_init(struct slz_istream *strm, int format);
+long slz_inflate(struct slz_istream *strm, void *out, long osize, const void *in, long ilen, long *used);
+
 /* Initializes stream <strm>. It will configure the stream to use format
  * <format> for the data, which must be one of SLZ_FMT_*. The compression level
- * passed in <level> is set. This value can only be 0 (no compression) or 1
- * (compression) and other values will lead to unpredictable behaviour. The
- * function should always return 0.
+ * passed in <level> is set. This value can only be 0 (no compression), 1
+ * (compression using fixed huffman trees), 2 (compression using dynamic
+ * huffman trees, about 20% smaller at the expense of 30-40% more CPU) or 3
+ * (same as 2 with 4-way hash buckets, a few percent smaller for about 30% more
+ * CPU), and other values will lead to unpredictable behaviour. The function
+ * should always return 0.
  */
 static inline int slz_init(struct slz_stream *strm, int level, int format)
 {
@@ -121,9 +255,63 @@ static inline int slz_init(struct slz_stream *strm, int level, int format)
 	return ret;
 }
 
+/* Same as slz_init() except that the references table used to look up matches
+ * will have up to 2^<hbits> entries of 8 bytes, allocated on the stack during
+ * each encoding call. The default is HASH_BITS (13, 64 kB). Smaller values fit
+ * into small caches, larger ones find more matches in large blocks. Small
+ * inputs automatically use a smaller table. Values out of the
+ * SLZ_HASH_BITS_MIN to SLZ_HASH_BITS_MAX range are capped.
+ */
+static inline int slz_init_ex(struct slz_stream *strm, int level, int format, int hbits)
+{
+	int ret = slz_init(strm, level, format);
+
+	strm->hbits = hbits > SLZ_HASH_BITS_MAX ? SLZ_HASH_BITS_MAX :
+	              hbits < SLZ_HASH_BITS_MIN ? SLZ_HASH_BITS_MIN : hbits;
+	return ret;
+}
+
+/* Sets the lazy matching depth of stream <strm> to <depth>, between 0 and 3.
+ * By default it is zero, meaning that the first match found at a given
+ * position is always used. Otherwise, before sending a short match, up to
+ * <depth> next positions are checked for a longer one, and if one is found
+ * the current byte is sent as a literal instead. This usually saves a few
+ * percent at the expense of some CPU usage, mostly for levels 2 and 3. It
+ * must be called after slz_init(), which resets it. Larger values are capped.
+ */
+static inline void slz_set_lazy(struct slz_stream *strm, int depth)
+{
+	strm->lazy = depth > 3 ? 3 : depth < 0 ? 0 : depth;
+}
+
+/* Enables (<on> non-zero) or disables the detection of incompressible input
+ * on stream <strm>. It is disabled by default. Once enabled, any input
+ * predicted not to compress by slz_incompressible() is sent as stored blocks,
+ * which is reported by the stream's <incomp> flag after each call. It must be
+ * called after slz_init(), which resets it.
+ */
+static inline void slz_set_prescan(struct slz_stream *strm, int on)
+{
+	strm->noscan = !on;
+}
+
+/* Enables (<on> non-zero) or disables the fast mode on stream <strm>. In this
+ * mode, after a few tens of consecutive bytes without any match, the encoder
+ * starts to skip some positions, sending them as literals without looking
+ * them up, and skips more as the misses accumulate, until the next match. This
+ * bounds the time spent on data which do not compress, at the expense of a
+ * few missed matches. It must be called after slz_init(), which resets it.
+ */
+static inline void slz_set_fast(struct slz_stream *strm, int on)
+{
+	strm->fast = !!on;
+}
+
 /* Encodes the block according to the format used by the stream. This means
  * that the CRC of the input block may be computed according to the CRC32 or
- * adler-32 algorithms. The number of output bytes is returned.
+ * adler-32 algorithms. The number of output bytes is returned. The output
+ * buffer must be large enough as described in slz_rfc1951_encode(), including
+ * the SLZ_OUT_SLACK extra bytes, which slz_bound() guarantees.
  */
 static inline long slz_encode(struct slz_stream *strm, void *out,
                               const void *in, long ilen, int more)
@@ -140,6 +328,76 @@ static inline long slz_encode(struct slz_stream *strm, void *out,
 	return ret;
 }
 
+/* Same as slz_encode() except that the <hlen> bytes from <hist> are used as a
+ * history window that matches may reference. These must be the last <hlen>
+ * bytes of uncompressed data previously passed to this stream, and only the
+ * last 32 kB are used. This is useful when the input comes in small fragments
+ * which do not compress well on their own. The history buffer belongs to the
+ * caller who has to keep it up to date for each stream.
+ */
+static inline long slz_encode_hist(struct slz_stream *strm, void *out,
+                                   const void *in, long ilen, int more,
+                                   const void *hist, long hlen)
+{
+	long ret;
+
+	if (strm->format == SLZ_FMT_GZIP)
+		ret = slz_rfc1952_encode_hist(strm, (unsigned char *) out, (const unsigned char *) in, ilen, more, (const unsigned char *) hist, hlen);
+	else if (strm->format == SLZ_FMT_ZLIB)
+		ret = slz_rfc1950_encode_hist(strm, (unsigned char *) out, (const unsigned char *) in, ilen, more, (const unsigned char *) hist, hlen);
+	else /* deflate for other ones */
+		ret = slz_rfc1951_encode_hist(strm, (unsigned char *) out, (const unsigned char *) in, ilen, more, (const unsigned char *) hist, hlen);
+
+	return ret;
+}
+
+/* Same as slz_encode_hist() except that the temporary data are placed into the
+ * workspace <ws> instead of the stack. It must be at least slz_workspace_size()
+ * bytes large for the stream's level and hash table size, and should be
+ * aligned to 64 bytes. The workspace is only used during the call, so a single
+ * one may be shared by all the streams of a thread. <hist> may be NULL if
+ * <hlen> is zero.
+ */
+static inline long slz_encode_ws(struct slz_stream *strm, void *out,
+                                 const void *in, long ilen, int more,
+                                 const void *hist, long hlen, void *ws)
+{
+	long ret;
+
+	if (strm->format == SLZ_FMT_GZIP)
+		ret = slz_rfc1952_encode_ws(strm, (unsigned char *) out, (const unsigned char *) in, ilen, more, (const unsigned char *) hist, hlen, ws);
+	else if (strm->format == SLZ_FMT_ZLIB)
+		ret = slz_rfc1950_encode_ws(strm, (unsigned char *) out, (const unsigned char *) in, ilen, more, (const unsigned char *) hist, hlen, ws);
+	else /* deflate for other ones */
+		ret = slz_rfc1951_encode_ws(strm, (unsigned char *) out, (const unsigned char *) in, ilen, more, (const unsigned char *) hist, hlen, ws);
+
+	return ret;
+}
+
+/* Flushes pending bits for stream <strm> into buffer <buf> without ending the
+ * stream, so that the receiver may decode all the data passed so far. This is
+ * done by closing the current block and sending an empty stored block, like
+ * zlib's Z_SYNC_FLUSH. Since the stream keeps no dictionary between calls, it
+ * is also a full flush (Z_FULL_FLUSH) as long as the next call passes no
+ * history. The header is sent first if needed. It returns the number of bytes
+ * emitted, which is at most 16, that the caller must ensure are available.
+ * Nothing is emitted once the last block was started by a call with <more>
+ * set to zero.
+ */
+static inline int slz_flush(struct slz_stream *strm, void *buf)
+{
+	int ret;
+
+	if (strm->format == SLZ_FMT_GZIP)
+		ret = slz_rfc1952_flush(strm, (unsigned char *) buf);
+	else if (strm->format == SLZ_FMT_ZLIB)
+		ret = slz_rfc1950_flush(strm, (unsigned char *) buf);
+	else /* deflate for other ones */
+		ret = slz_rfc1951_flush(strm, (unsigned char *) buf);
+
+	return ret;
+}
+
 /* Flushes pending bits and sends the trailer for stream <strm> into buffer
  * <buf> if needed. When it's done, the stream state is updated to SLZ_ST_END.
  * It returns the number of bytes emitted. The trailer consists in flushing the
@@ -162,4 +420,27 @@ static inline int slz_finish(struct slz_stream *strm, void *buf)
 	return ret;
 }
 
+/* Returns the maximum number of bytes that may be written when passing <ilen>
+ * bytes to any of the slz_encode*() functions in a single call then calling
+ * slz_finish(), whatever the format, level and options. It includes the
+ * SLZ_OUT_SLACK bytes, so it is the size of the output buffer to allocate.
+ * Literals take at most 9 bits and matches at most 8 bits per byte, and stored
+ * blocks are only used when they save more than they cost, hence the 1/8
+ * ratio. The remaining bytes cover the gzip header (10), the blocks opened and
+ * closed by slz_encode*() (7), the end of the stream (3) and the gzip trailer
+ * (8). slz_encode_mt() may emit 6 extra bytes per thread.
+ */
+static inline long slz_bound(long ilen)
+{
+	return ilen + (ilen >> 3) + 28 + SLZ_OUT_SLACK;
+}
+
+/* Returns non-zero once the end of the stream was decoded and its checksum
+ * verified by slz_inflate().
+ */
+static inline int slz_inflate_done(const struct slz_istream *strm)
+{
+	return strm->state == SLZ_IS_END;
+}
+
 #endif
@@ -0,0 +1,733 @@
+/*
+ * Copyright (C) 2013-2015 Willy Tarreau <w@1wt.eu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#include "slz.h"
+
+/* default sweep */
+#define BLOCKS  "1k,4k,16k,64k,256k,1m"
+#define LEVELS  "0,1,2,3"
+#define FORMATS "gzd"
+#define MIN_MS  100
+
+/* levels of the zlib rows */
+static const int zlib_levels[] = { 1, 6 };
+
+/* one letter per SLZ_FMT_* */
+static const char fmt_names[] = "gzd";
+
+/* one file to compress */
+struct file {
+	const char *name;
+	unsigned char *data;
+	long len;
+};
+
+/* what is measured in one row */
+struct job {
+	const struct file *file;
+	long blk;      /* block size */
+	int format;    /* SLZ_FMT_* */
+	int level;
+	int zlib;      /* 1 = use zlib instead of SLZ */
+};
+
+/* results of one row, or of one thread in threaded mode */
+struct row {
+	long totin;    /* total input bytes */
+	long totout;   /* total output bytes */
+	long calls;    /* number of calls measured */
+	uint64_t ns;   /* total wall time */
+	uint64_t cyc;  /* total TSC cycles, 0 if unsupported */
+	uint64_t *lat; /* per-call latencies in nanoseconds, kept across rows */
+	long lat_size; /* number of entries allocated in <lat> */
+};
+
+/* one worker of the threaded mode */
+struct worker {
+	pthread_t thr;
+	pthread_barrier_t *barrier;
+	const struct job *job;
+	int cpu;            /* CPU to pin the thread to */
+	int min_ms;
+	unsigned char *out;
+	long osize;
+	struct row row;
+	int llc_ok;         /* LLC counters could be read */
+	uint64_t llc_ref;   /* LLC references */
+	uint64_t llc_miss;  /* LLC misses */
+};
+
+/* width of the file name column */
+static int name_width = 6;
+
+/* CPUs the threads are pinned to, in order */
+static int cpus[CPU_SETSIZE];
+static int ncpus;
+
+/* display the message and exit with the code */
+__attribute__((noreturn)) void die(int code, const char *format, ...)
+{
+        va_list args;
+
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        exit(code);
+}
+
+__attribute__((noreturn)) void usage(const char *name, int code)
+{
+	die(code,
+	    "Usage: %s [option]* file...\n"
+	    "\n"
+	    "Compresses each file in every combination of block size, format and level\n"
+	    "and reports the input bandwidth, the output ratio, the cycles per input byte\n"
+	    "and the latency percentiles of each call. The following arguments are\n"
+	    "supported :\n"
+	    "  -b <list>  comma-separated block sizes, with optional k/m suffix\n"
+	    "             [" BLOCKS "]\n"
+	    "  -C <cpu>   force the set of CPU-specific functions, among generic,\n"
+	    "             sse2, ssse3, clmul, avx2, vpclmul [best supported]\n"
+	    "  -f <list>  formats among g (gzip), z (zlib) and d (deflate) [" FORMATS "]\n"
+	    "  -h         display this help\n"
+	    "  -L <list>  comma-separated compression levels [" LEVELS "]\n"
+	    "  -p <list>  comma-separated numbers of threads, each compressing its\n"
+	    "             own streams on its own CPU, instead of a single one\n"
+	    "  -T <ms>    run each row for at least <ms> milliseconds [%d]\n"
+	    "  -z         do not report zlib -1 and -6 rows\n"
+	    "\n"
+	    "Each block is passed in a separate call to the same stream, and each loop\n"
+	    "over a file starts a new stream, whose initialization is accounted to the\n"
+	    "first call. Cycles are TSC cycles, only reported on x86. With -p, the rows\n"
+	    "report the input bandwidth per thread and in total, the efficiency compared\n"
+	    "to the first number of threads, and the last level cache references and\n"
+	    "misses per input kB when perf_event_open() is permitted, as well as the\n"
+	    "memory bandwidth implied by the misses.\n"
+	    "\n"
+	    ,name, MIN_MS);
+}
+
+/* returns the current monotonic time in nanoseconds */
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* returns the TSC, or 0 when not available */
+static inline uint64_t now_cyc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* records the latency <ns> of the next call of row <row> */
+static void add_lat(struct row *row, uint64_t ns)
+{
+	if (row->calls >= row->lat_size) {
+		row->lat_size = row->lat_size ? row->lat_size * 2 : 65536;
+		row->lat = realloc(row->lat, row->lat_size * sizeof(*row->lat));
+		if (!row->lat) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	row->lat[row->calls++] = ns;
+}
+
+/* resets row <row>, keeping the latencies array */
+static void reset_row(struct row *row)
+{
+	uint64_t *lat = row->lat;
+	long lat_size = row->lat_size;
+
+	memset(row, 0, sizeof(*row));
+	row->lat = lat;
+	row->lat_size = lat_size;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Parses a comma-separated list of at most <max> sizes with an optional k or
+ * m suffix into <sizes>. Returns the number of entries or 0 on error.
+ */
+static int parse_list(const char *str, long *sizes, int max)
+{
+	char *end;
+	int n = 0;
+
+	while (*str && n < max) {
+		sizes[n] = strtol(str, &end, 10);
+		if (end == str)
+			return 0;
+		if (*end == 'k' || *end == 'K')
+			sizes[n] <<= 10, end++;
+		else if (*end == 'm' || *end == 'M')
+			sizes[n] <<= 20, end++;
+		n++;
+		if (*end != ',')
+			return *end ? 0 : n;
+		str = end + 1;
+	}
+	return 0;
+}
+
+/* loads file <name> into <file>, dies on error */
+static void load_file(struct file *file, const char *name)
+{
+	long size = 0;
+	long ret;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd == -1) {
+		perror(name);
+		exit(1);
+	}
+
+	file->name = name;
+	file->data = NULL;
+	file->len  = 0;
+	while (1) {
+		if (file->len == size) {
+			size = size ? size * 2 : 1048576;
+			file->data = realloc(file->data, size);
+			if (!file->data) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		ret = read(fd, file->data + file->len, size - file->len);
+		if (ret < 0) {
+			perror("read");
+			exit(2);
+		}
+		if (!ret)
+			break;
+		file->len += ret;
+	}
+	close(fd);
+}
+
+/* Compresses <file> once with SLZ in blocks of <blk> bytes into <out> and
+ * accounts for it into <row>.
+ */
+static void run_slz(const struct file *file, long blk, int format, int level,
+                    unsigned char *out, struct row *row)
+{
+	struct slz_stream strm;
+	uint64_t t0, c0, t1;
+	long ofs = 0, ilen, len;
+
+	t0 = now_ns();
+	c0 = now_cyc();
+	slz_init(&strm, level, format);
+	do {
+		ilen = file->len - ofs > blk ? blk : file->len - ofs;
+		ofs += ilen;
+		len = slz_encode(&strm, out, file->data + ofs - ilen, ilen, ofs < file->len);
+		if (ofs == file->len)
+			len += slz_finish(&strm, out + len);
+		row->totout += len;
+
+		t1 = now_ns();
+		add_lat(row, t1 - t0);
+		t0 = t1;
+	} while (ofs < file->len);
+	row->cyc   += now_cyc() - c0;
+	row->totin += file->len;
+}
+
+#ifdef USE_ZLIB
+/* Same as run_slz() using zlib at level <level> */
+static void run_zlib(const struct file *file, long blk, int format, int level,
+                     unsigned char *out, long osize, struct row *row)
+{
+	z_stream z;
+	uint64_t t0, c0, t1;
+	long ofs = 0, ilen;
+	int flush;
+
+	t0 = now_ns();
+	c0 = now_cyc();
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, level, Z_DEFLATED,
+	                 format == SLZ_FMT_GZIP ? 31 : format == SLZ_FMT_ZLIB ? 15 : -15,
+	                 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		die(1, "deflateInit2() failed\n");
+	do {
+		ilen = file->len - ofs > blk ? blk : file->len - ofs;
+		ofs += ilen;
+		flush = ofs < file->len ? Z_NO_FLUSH : Z_FINISH;
+		z.next_in  = file->data + ofs - ilen;
+		z.avail_in = ilen;
+		do {
+			z.next_out  = out;
+			z.avail_out = osize;
+			deflate(&z, flush);
+			row->totout += osize - z.avail_out;
+		} while (!z.avail_out);
+		if (flush == Z_FINISH)
+			deflateEnd(&z);
+
+		t1 = now_ns();
+		add_lat(row, t1 - t0);
+		t0 = t1;
+	} while (ofs < file->len);
+	row->cyc   += now_cyc() - c0;
+	row->totin += file->len;
+}
+#endif
+
+/* Runs job <job> in loops into <out> of <osize> bytes for at least <min_ms>
+ * milliseconds and accounts for it into <row>.
+ */
+static void run_job(const struct job *job, unsigned char *out, long osize, int min_ms, struct row *row)
+{
+	uint64_t start = now_ns();
+
+	do {
+#ifdef USE_ZLIB
+		if (job->zlib)
+			run_zlib(job->file, job->blk, job->format, job->level, out, osize, row);
+		else
+#endif
+			run_slz(job->file, job->blk, job->format, job->level, out, row);
+		row->ns = now_ns() - start;
+	} while (row->ns < min_ms * 1000000ULL);
+}
+
+/* Opens a counter of hardware event <config> for the calling thread, which is
+ * left disabled. Returns the file descriptor, or -1 if not permitted.
+ */
+static int perf_open(uint64_t config)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+/* Worker of the threaded mode: pins itself to its CPU, waits for the other
+ * ones to be ready, then runs its job, counting the last level cache
+ * references and misses if possible.
+ */
+static void *bench_thread(void *arg)
+{
+	struct worker *w = arg;
+	cpu_set_t set;
+	int fd_ref, fd_miss;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	fd_ref  = perf_open(PERF_COUNT_HW_CACHE_REFERENCES);
+	fd_miss = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+
+	pthread_barrier_wait(w->barrier);
+	if (fd_ref >= 0 && fd_miss >= 0) {
+		ioctl(fd_ref, PERF_EVENT_IOC_ENABLE, 0);
+		ioctl(fd_miss, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	run_job(w->job, w->out, w->osize, w->min_ms, &w->row);
+
+	w->llc_ok = 0;
+	if (fd_ref >= 0 && fd_miss >= 0) {
+		ioctl(fd_ref, PERF_EVENT_IOC_DISABLE, 0);
+		ioctl(fd_miss, PERF_EVENT_IOC_DISABLE, 0);
+		w->llc_ok = read(fd_ref, &w->llc_ref, sizeof(w->llc_ref)) == sizeof(w->llc_ref) &&
+		            read(fd_miss, &w->llc_miss, sizeof(w->llc_miss)) == sizeof(w->llc_miss);
+	}
+	if (fd_ref >= 0)
+		close(fd_ref);
+	if (fd_miss >= 0)
+		close(fd_miss);
+	return NULL;
+}
+
+/* Runs job <job> in <nthr> workers from <workers> at once, the first ones
+ * being pinned to distinct CPUs.
+ */
+static void run_threads(const struct job *job, struct worker *workers, int nthr, int min_ms)
+{
+	pthread_barrier_t barrier;
+	int t;
+
+	pthread_barrier_init(&barrier, NULL, nthr);
+	for (t = 0; t < nthr; t++) {
+		workers[t].barrier = &barrier;
+		workers[t].job = job;
+		workers[t].cpu = cpus[t % ncpus];
+		workers[t].min_ms = min_ms;
+		reset_row(&workers[t].row);
+		if (pthread_create(&workers[t].thr, NULL, bench_thread, &workers[t]) != 0)
+			die(1, "Cannot create thread %d\n", t);
+	}
+	for (t = 0; t < nthr; t++)
+		pthread_join(workers[t].thr, NULL);
+	pthread_barrier_destroy(&barrier);
+}
+
+/* prints the columns common to all rows for job <job>, whose output is
+ * <totout> bytes for <totin> bytes of input.
+ */
+static void print_job(const struct job *job, long totin, long totout)
+{
+	char bstr[24];
+
+	if (job->blk >= 1048576 && !(job->blk & 1048575))
+		snprintf(bstr, sizeof(bstr), "%ldM", job->blk >> 20);
+	else if (job->blk >= 1024 && !(job->blk & 1023))
+		snprintf(bstr, sizeof(bstr), "%ldk", job->blk >> 10);
+	else
+		snprintf(bstr, sizeof(bstr), "%ld", job->blk);
+
+	printf("%-*s %-4s %3d  %c  %5s %7.2f%% ",
+	       name_width, job->file->name, job->zlib ? "zlib" : "slz",
+	       job->level, fmt_names[job->format], bstr,
+	       totout * 100.0 / totin);
+}
+
+/* prints row <row> for job <job> */
+static void print_row(const struct job *job, struct row *row)
+{
+	uint64_t *lat = row->lat;
+
+	qsort(lat, row->calls, sizeof(*lat), cmp_u64);
+
+	print_job(job, row->totin, row->totout);
+	printf("%8.1f ", row->totin * 1000.0 / row->ns);
+
+	if (row->cyc)
+		printf("%6.2f ", (double)row->cyc / row->totin);
+	else
+		printf("%6s ", "-");
+
+	printf("%9.1f %9.1f %9.1f %9.1f\n",
+	       lat[row->calls / 2] / 1000.0,
+	       lat[row->calls * 9 / 10] / 1000.0,
+	       lat[row->calls * 99 / 100] / 1000.0,
+	       lat[row->calls - 1] / 1000.0);
+	fflush(stdout);
+}
+
+/* Prints the row of job <job> for the <nthr> workers in <workers>. <ref> is
+ * the bandwidth per thread of the first row of the sweep, or 0 if this is the
+ * first row, and the bandwidth per thread of this row is returned. The total
+ * bandwidth is the input of all threads divided by the time taken by the
+ * slowest one, since they all start at once.
+ */
+static double print_thr_row(const struct job *job, const struct worker *workers, int nthr, double ref)
+{
+	long totin = 0, totout = 0;
+	uint64_t llc_ref = 0, llc_miss = 0, ns = 0;
+	double bw;
+	int llc_ok = 1;
+	int t;
+
+	for (t = 0; t < nthr; t++) {
+		totin  += workers[t].row.totin;
+		totout += workers[t].row.totout;
+		if (workers[t].row.ns > ns)
+			ns = workers[t].row.ns;
+		llc_ok   &= workers[t].llc_ok;
+		llc_ref  += workers[t].llc_ref;
+		llc_miss += workers[t].llc_miss;
+	}
+
+	bw = totin * 1000.0 / ns;
+	print_job(job, totin, totout);
+	printf("%4d %9.1f %9.1f %5.1f%% ", nthr, bw / nthr, bw, ref ? bw / nthr * 100.0 / ref : 100.0);
+	if (llc_ok)
+		printf("%9.1f %9.2f %9.1f\n",
+		       llc_ref * 1024.0 / totin, llc_miss * 1024.0 / totin,
+		       llc_miss * 64 * 1000.0 / ns);
+	else
+		printf("%9s %9s %9s\n", "-", "-", "-");
+	fflush(stdout);
+	return bw / nthr;
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = argv[0];
+	const char *formats = FORMATS;
+	struct file *files;
+	struct job job;
+	struct row row;
+	struct worker *workers = NULL;
+	unsigned char *outbuf;
+	long blocks[32], levels[32], threads[32];
+	long osize, maxblk;
+	int nblocks, nlevels, nfiles, nthreads = 0, maxthr = 0;
+	int f, b, l, i, t;
+	int min_ms = MIN_MS;
+	int cpu = -1;
+	int use_zlib = 1;
+	double ref, bw;
+	cpu_set_t set;
+
+	nblocks = parse_list(BLOCKS, blocks, 32);
+	nlevels = parse_list(LEVELS, levels, 32);
+
+	argv++;
+	argc--;
+
+	while (argc > 0) {
+		if (**argv != '-')
+			break;
+
+		if (strcmp(argv[0], "-b") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			nblocks = parse_list(argv[1], blocks, 32);
+			if (!nblocks)
+				usage(name, 1);
+			for (i = 0; i < nblocks; i++)
+				if (blocks[i] <= 0)
+					usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-C") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			cpu = slz_cpu_by_name(argv[1]);
+			if (cpu < 0)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-f") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			formats = argv[1];
+			if (!*formats || strspn(formats, "gzd") != strlen(formats))
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-h") == 0)
+			usage(name, 0);
+
+		else if (strcmp(argv[0], "-L") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			nlevels = parse_list(argv[1], levels, 32);
+			if (!nlevels)
+				usage(name, 1);
+			for (i = 0; i < nlevels; i++)
+				if (levels[i] < 0 || levels[i] > 3)
+					usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-p") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			nthreads = parse_list(argv[1], threads, 32);
+			if (!nthreads)
+				usage(name, 1);
+			for (i = 0; i < nthreads; i++)
+				if (threads[i] <= 0 || threads[i] > 1024)
+					usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-T") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			min_ms = atoi(argv[1]);
+			if (min_ms < 0)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-z") == 0)
+			use_zlib = 0;
+
+		else
+			usage(name, 1);
+
+		argv++;
+		argc--;
+	}
+
+	if (argc <= 0)
+		usage(name, 1);
+
+#ifndef USE_ZLIB
+	use_zlib = 0;
+#endif
+
+	/* threads are pinned to the allowed CPUs in turn */
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &set))
+				cpus[ncpus++] = i;
+	}
+	if (!ncpus)
+		ncpus = 1;
+
+	slz_make_crc_table();
+	slz_prepare_dist_table();
+	if (cpu >= 0)
+		slz_set_cpu(cpu);
+
+	nfiles = argc;
+	files = calloc(nfiles, sizeof(*files));
+	if (!files) {
+		perror("calloc");
+		exit(1);
+	}
+	for (f = 0; f < nfiles; f++) {
+		load_file(&files[f], argv[f]);
+		if ((int)strlen(argv[f]) > name_width)
+			name_width = strlen(argv[f]);
+	}
+
+	/* each call's output fits in this buffer, including the trailer */
+	maxblk = 0;
+	for (b = 0; b < nblocks; b++)
+		if (blocks[b] > maxblk)
+			maxblk = blocks[b];
+	osize = slz_bound(maxblk) + 64;
+	outbuf = malloc(osize);
+	if (!outbuf) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* each worker has its own output buffer */
+	for (t = 0; t < nthreads; t++)
+		if (threads[t] > maxthr)
+			maxthr = threads[t];
+	if (maxthr) {
+		workers = calloc(maxthr, sizeof(*workers));
+		if (!workers) {
+			perror("calloc");
+			exit(1);
+		}
+		for (t = 0; t < maxthr; t++) {
+			workers[t].osize = osize;
+			workers[t].out = malloc(osize);
+			if (!workers[t].out) {
+				perror("malloc");
+				exit(1);
+			}
+		}
+	}
+
+	printf("# cpu=%s min_time=%dms\n", slz_cpu_name(slz_get_cpu()), min_ms);
+	if (!nthreads)
+		printf("%-*s %-4s %3s %3s %5s %8s %8s %6s %9s %9s %9s %9s\n",
+		       name_width, "# file", "lib", "lvl", "fmt", "block", "ratio", "MB/s", "cyc/B",
+		       "p50(us)", "p90(us)", "p99(us)", "max(us)");
+	else
+		printf("%-*s %-4s %3s %3s %5s %8s %4s %9s %9s %6s %9s %9s %9s\n",
+		       name_width, "# file", "lib", "lvl", "fmt", "block", "ratio", "thr",
+		       "MB/s/thr", "MB/s", "eff", "LLCref/kB", "LLCmis/kB", "mem MB/s");
+
+	memset(&row, 0, sizeof(row));
+	for (f = 0; f < nfiles; f++) {
+		if (!files[f].len)
+			continue;
+		job.file = &files[f];
+		for (i = 0; formats[i]; i++) {
+			job.format = strchr(fmt_names, formats[i]) - fmt_names;
+			for (b = 0; b < nblocks; b++) {
+				job.blk = blocks[b];
+				/* SLZ levels first, then zlib's */
+				for (l = 0; l < nlevels + (use_zlib ? 2 : 0); l++) {
+					job.zlib  = l >= nlevels;
+					job.level = job.zlib ? zlib_levels[l - nlevels] : levels[l];
+
+					if (!nthreads) {
+						reset_row(&row);
+						run_job(&job, outbuf, osize, min_ms, &row);
+						print_row(&job, &row);
+						continue;
+					}
+
+					ref = 0;
+					for (t = 0; t < nthreads; t++) {
+						run_threads(&job, workers, threads[t], min_ms);
+						bw = print_thr_row(&job, workers, threads[t], ref);
+						if (!t)
+							ref = bw;
+					}
+				}
+			}
+		}
+	}
+	return 0;
+}
@@ -23,248 +23,209 @@
  */
 
 #include <errno.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include "slz.h"
 
-static uint32_t queue;
-static uint32_t qbits; /* number of bits in queue, < 16 */
-static int pos;
+/* default input and output block sizes */
+#define IBLK 32768
+#define OBLK 65536
 
-static const int base_len[] = {
-	3, 4, 5, 6, 7, 8, 9, 10, 11, 13,
-	15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
-	67, 83, 99, 115, 131, 163, 195, 227, 258
-};
-
-static const int base_dist[] = {
-	1, 2, 3, 4, 5, 7, 9, 13, 17, 25,
-	33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
-	1025, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-};
-
-/* ensures we always have at least 16 bits in the queue or that end is reached.
- * It returns 0 when end is reached and last bit was read.
- */
-int refill_queue()
-{
-	int c;
-
-	if (qbits >= 16)
-		return 1;
-
-	do {
-		c = getchar();
-		if (c == EOF)
-			return qbits ? 1 : 0;
-		queue += (uint32_t)c << qbits;
-		qbits += 8;
-		pos++;
-	} while (qbits < 16);
-	return 1;
-}
-
-/* returns position in the stream of the current queue being read */
-int get_pos()
+/* display the message and exit with the code */
+__attribute__((noreturn)) void die(int code, const char *format, ...)
 {
-	return pos - 1 - (qbits / 8);
-}
-
-int get_bit()
-{
-	return 8 - (qbits & 7);
-}
+        va_list args;
 
-int swap_bits(uint32_t x, int bits)
-{
-	uint32_t y = 0;
-
-	while (bits) {
-		y <<= 1;
-		y += x & 1;
-		x >>= 1;
-		bits--;
-	}
-	return y;
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        exit(code);
 }
 
-void advance_queue(int bits)
+__attribute__((noreturn)) void usage(const char *name, int code)
 {
-	queue >>= bits;
-	qbits -= bits;
+	die(code,
+	    "Usage: %s [option]* [file]\n"
+	    "\n"
+	    "The following arguments are supported :\n"
+	    "  -C <cpu>   force the set of CPU-specific functions, among generic,\n"
+	    "             sse2, ssse3, clmul, avx2, vpclmul [best supported]\n"
+	    "  -h         display this help\n"
+	    "  -i <size>  pass the input in chunks of <size> bytes [32768]\n"
+	    "  -l <loops> loop <loops> times over the same input\n"
+	    "  -o <size>  use an output buffer of <size> bytes (>= 258) [65536]\n"
+	    "  -t         test mode: do not emit anything\n"
+	    "  -v         increase verbosity\n"
+	    "\n"
+	    "  -D         use raw Deflate input format (RFC1951)\n"
+	    "  -G         use Gzip input format (RFC1952) [default]\n"
+	    "  -Z         use Zlib input format (RFC1950)\n"
+	    "\n"
+	    "If no file is specified, stdin will be used instead.\n"
+	    "\n"
+	    ,name);
 }
 
-void next_boundary()
+int main(int argc, char **argv)
 {
-	if (!refill_queue())
-		return;
-
-	advance_queue(qbits & 7);
-}
-
-/* reads next code, returns the code or -1 when end is reached */
-int get_huff_code()
-{
-	int code = 0;
-
-	if (!refill_queue())
-		return -1;
-
-	switch (swap_bits(queue & 0x3F, 6)) {
-	case 0x00 ... 0x0B: /* 7 bits, 256-279 */
-		code = swap_bits(queue, 7) - 0x00 + 256;
-		advance_queue(7);
-		break;
-	case 0x0C ... 0x2F: /* 8 bits, 0-143 */
-		code = swap_bits(queue, 8) - 0x30 + 0;
-		advance_queue(8);
-		break;
-	case 0x30 ... 0x31: /* 8 bits, 280-287 */
-		code = swap_bits(queue, 8) - 0xc0 + 280;
-		advance_queue(8);
-		break;
-	case 0x32 ... 0x3F: /* 9 bits, 144-255 */
-		code = swap_bits(queue, 9) - 0x190 + 144;
-		advance_queue(9);
-		break;
-	}
-	return code;
-}
-
-/* returns -1 if eof, 1 if BFINAL is set, otherwise 0 */
-int get_bfinal()
-{
-	int ret = queue & 1;
-
-	if (!refill_queue())
-		return -1;
-
-	advance_queue(1);
-	return ret;
-}
+	const char *name = argv[0];
+	struct slz_istream strm;
+	unsigned char *outbuf;
+	unsigned char *buffer = NULL;
+	long buflen = 0;
+	long bufsize = 0;
+	long totin = 0;
+	long totout = 0;
+	long ofs, ilen, used, ret;
+	int loops = 1;
+	int iblk = IBLK;
+	int oblk = OBLK;
+	int cpu = -1;
+	int verbose = 0;
+	int test    = 0;
+	int format  = SLZ_FMT_GZIP;
+	int fd = 0;
+
+	argv++;
+	argc--;
+
+	while (argc > 0) {
+		if (**argv != '-')
+			break;
 
-/* returns -1 if eof, 0..3 for BTYPE */
-int get_btype()
-{
-	int ret = queue & 3;
+		if (strcmp(argv[0], "-C") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			cpu = slz_cpu_by_name(argv[1]);
+			if (cpu < 0)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
 
-	if (!refill_queue())
-		return -1;
+		else if (strcmp(argv[0], "-h") == 0)
+			usage(name, 0);
+
+		else if (strcmp(argv[0], "-i") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			iblk = atoi(argv[1]);
+			if (iblk <= 0)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
 
-	advance_queue(2);
-	return ret;
-}
+		else if (strcmp(argv[0], "-l") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			loops = atoi(argv[1]);
+			if (loops <= 0)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
 
-/* returns -1 if eof, or >0 after reading <bits> bits */
-int get_bits(int bits)
-{
-	int ret;
+		else if (strcmp(argv[0], "-o") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			oblk = atoi(argv[1]);
+			if (oblk < 258)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
 
-	if (!refill_queue())
-		return -1;
+		else if (strcmp(argv[0], "-t") == 0)
+			test = 1;
 
-	ret = queue & ((1 << bits) - 1);
-	advance_queue(bits);
-	return ret;
-}
+		else if (strcmp(argv[0], "-v") == 0)
+			verbose++;
 
-int get_len(int code, int extra)
-{
-	if (code < 257 || code > 285)
-		return 0;
-	return base_len[code - 257] + extra;
-}
+		else if (strcmp(argv[0], "-D") == 0)
+			format = SLZ_FMT_DEFLATE;
 
-int get_dist(int code, int extra)
-{
-	if (code < 0 || code > 29)
-		return 0;
-	return base_dist[code] + extra;
-}
+		else if (strcmp(argv[0], "-G") == 0)
+			format = SLZ_FMT_GZIP;
 
-int main(void)
-{
-	int bfinal = 0;
-	int btype = 0;
-	int code = 0;
-	int ofs = 0;
+		else if (strcmp(argv[0], "-Z") == 0)
+			format = SLZ_FMT_ZLIB;
 
-	getchar(); // ID1
-	getchar(); // ID2
-	getchar(); // CM
-	getchar(); // FLG
-	getchar(); getchar(); getchar(); getchar(); // MTIME
-	getchar(); // XFL
-	getchar(); // OS
+		else
+			usage(name, 1);
 
-	while (!bfinal) {
-		printf("@0x%04x_%d: ", get_pos(), get_bit());
-		bfinal = get_bfinal();
-		btype = get_btype();
-		printf("BTYPE = %1x BFINAL = %d\n", btype, bfinal);
+		argv++;
+		argc--;
+	}
 
-		switch (btype) {
-		case 0: /* no compression : <boundary> LEN16 | NLEN16 | LEN bytes */
-			printf("  no compression <not implemented>\n");
+	if (argc > 0) {
+		fd = open(argv[0], O_RDONLY);
+		if (fd == -1) {
+			perror("open()");
 			exit(1);
-			break;
-		case 1:
-			printf("  compressed with huffman\n");
-			while (1) {
-				printf("    @z: 0x%04x_%d @raw: %d [0x%06x]: ", get_pos(), get_bit(), ofs, queue);
-				code = get_huff_code();
-				printf("code = %3d", code);
-				if (code < 0) {
-					putchar('\n');
-					exit(1);
-				}
-
-				if (code == 256) {
-					printf("=> EOB\n");
-					break;
-				}
-
-				if (code > 256) {
-					int xbits;
-					int data;
-					int len;
+		}
+	}
 
-					xbits = ((code - 257) / 4) - 1;
-					if (xbits < 0)
-						xbits = 0;
-					else if (xbits > 5)
-						xbits = 0;
-					data = get_bits(xbits);
-					len = get_len(code, data);
-					printf (" => ref: xbits=%d [%d] len=%d", xbits, data, len);
-					ofs += len;
+	slz_make_crc_table();
+	slz_prepare_dist_table();
+	if (cpu >= 0)
+		slz_set_cpu(cpu);
+
+	/* the whole input is loaded first so that it may be decoded in loops */
+	while (1) {
+		if (buflen == bufsize) {
+			bufsize = bufsize ? bufsize * 2 : 1048576;
+			buffer = realloc(buffer, bufsize);
+			if (!buffer) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		ret = read(fd, buffer + buflen, bufsize - buflen);
+		if (ret < 0) {
+			perror("read");
+			exit(2);
+		}
+		if (!ret)
+			break;
+		buflen += ret;
+	}
 
-					code = get_bits(5);  // 5 bits
-					code = swap_bits(code, 5); // distance is encoded with bits swapped
+	outbuf = malloc(oblk);
+	if (!outbuf) {
+		perror("malloc");
+		exit(1);
+	}
 
-					xbits = (code / 2) - 1;
-					if (xbits < 0)
-						xbits = 0;
-					data = get_bits(xbits);
-					printf (" code=%d xbits=%d [%d] dist=%d\n", code, xbits, data, get_dist(code, data));
-				}
-				else {
-					ofs++;
-					printf(" (0x%03x)\n", code);
-				}
+	while (loops--) {
+		slz_inflate_init(&strm, format);
+		ofs = 0;
+		do {
+			/* unconsumed bytes are passed again with the next chunk */
+			ilen = buflen - ofs > iblk ? iblk : buflen - ofs;
+			ret = slz_inflate(&strm, outbuf, oblk, buffer + ofs, ilen, &used);
+			if (ret < 0)
+				die(3, "Invalid input at byte %ld: %s\n", ofs, strm.msg);
+			ofs += used;
+			totout += ret;
+			if (!test)
+				write(1, outbuf, ret);
+			if (!ret && !used && !slz_inflate_done(&strm)) {
+				if (ilen == buflen - ofs)
+					die(3, "Truncated input at byte %ld\n", ofs);
+				iblk *= 2; /* a block header spans more than one chunk */
 			}
-			break;
-		case 2:
-			printf("  compressed with dynamic huffman <not implemented>\n");
-			exit(1);
-			break;
-		case 3:
-			printf("  reserved <not implemented>\n");
-			exit(1);
-			break;
-		}
+		} while (!slz_inflate_done(&strm));
+		totin += ofs;
 	}
+
+	if (verbose)
+		fprintf(stderr, "totin=%ld totout=%ld ratio=%.2f%% crc32=%08x cpu=%s\n", totin, totout, totin * 100.0 / (totout ? totout : 1), strm.crc32, slz_cpu_name(slz_get_cpu()));
+
 	return 0;
 }
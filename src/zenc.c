@@ -43,6 +43,7 @@
 
 /* block size for experimentations */
 #define BLK 32768
+#define MT_BLK (1024 * 1024)
 
 /* display the message and exit with the code */
 __attribute__((noreturn)) void die(int code, const char *format, ...)
@@ -63,13 +64,32 @@ __attribute__((noreturn)) void usage(const char *name, int code)
 	    "The following arguments are supported :\n"
 	    "  -0         disable compression, only uses format\n"
 	    "  -1         enable compression [default]\n"
+	    "  -2         enable compression with dynamic huffman trees\n"
+	    "  -3         same as -2 with 4 entries per hash bucket\n"
 	    "  -b <size>  only use <size> bytes from the input file\n"
+	    "  -B <bits>  use a hash table of 2^<bits> entries (10..15) [13]\n"
 	    "  -c         send output to stdout [default]\n"
+	    "  -C <cpu>   force the set of CPU-specific functions, among generic,\n"
+	    "             sse2, ssse3, clmul, avx2, vpclmul [best supported]\n"
 	    "  -f         force sending output to a terminal\n"
+	    "  -F         fast mode: skip faster over data without matches\n"
 	    "  -h         display this help\n"
+	    "  -H <size>  pass up to <size> bytes of previous input as history\n"
+	    "  -i         detect incompressible input and store it without compressing\n"
+	    "             it (slz_set_prescan())\n"
+	    "  -I <size>  pass each chunk as an iovec of <size> bytes segments\n"
 	    "  -l <loops> loop <loops> times over the same file\n"
+	    "  -L <depth> set the lazy matching depth (0..3) [0]\n"
+	    "  -n         disable the detection of incompressible input [default]\n"
+	    "  -o <size>  emit output buffers of at most <size> bytes\n"
+	    "  -p <num>   compress each chunk using <num> threads [1]\n"
+	    "  -s <size>  compress the input in chunks of <size> bytes [32768,\n"
+	    "             or 1 MB per thread with -p]\n"
+	    "  -S         flush the output after each chunk (sync flush)\n"
 	    "  -t         test mode: do not emit anything\n"
-	    "  -v         increase verbosity\n"
+	    "  -v         increase verbosity, twice to report the encoder statistics\n"
+	    "             when built with SLZ_STATS\n"
+	    "  -W         use a heap-allocated workspace instead of the stack\n"
 	    "\n"
 	    "  -D         use raw Deflate output format (RFC1951)\n"
 	    "  -G         use Gzip output format (RFC1952) [default]\n"
@@ -86,14 +106,32 @@ int main(int argc, char **argv)
 	const char *name = argv[0];
 	struct stat instat;
 	struct slz_stream strm;
+	struct slz_stats stats;
 	unsigned char *outbuf;
 	unsigned char *buffer;
+	void *workspace = NULL;
 	int buflen;
 	int totin = 0;
 	int totout = 0;
 	int ofs;
 	int len;
 	int loops = 1;
+	int blk = 0;
+	int threads = 1;
+	int hist = 0;
+	int hlen;
+	int lazy = 0;
+	int prescan = 0;
+	int fast = 0;
+	int osize = 0;
+	int obufs = 0;
+	int segsize = 0;
+	int sync = 0;
+	struct iovec *iov = NULL;
+	int iovcnt;
+	int cpu = -1;
+	int stored = 0;
+	int hbits = HASH_BITS;
 	int bufsize = 0;
 	int console = 1;
 	int level   = 1;
@@ -116,6 +154,12 @@ int main(int argc, char **argv)
 		else if (strcmp(argv[0], "-1") == 0)
 			level = 1;
 
+		else if (strcmp(argv[0], "-2") == 0)
+			level = 2;
+
+		else if (strcmp(argv[0], "-3") == 0)
+			level = 3;
+
 		else if (strcmp(argv[0], "-b") == 0) {
 			if (argc < 2)
 				usage(name, 1);
@@ -124,15 +168,44 @@ int main(int argc, char **argv)
 			argc--;
 		}
 
+		else if (strcmp(argv[0], "-B") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			hbits = atoi(argv[1]);
+			argv++;
+			argc--;
+		}
+
 		else if (strcmp(argv[0], "-c") == 0)
 			console = 1;
 
+		else if (strcmp(argv[0], "-C") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			cpu = slz_cpu_by_name(argv[1]);
+			if (cpu < 0)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
+
 		else if (strcmp(argv[0], "-f") == 0)
 			force = 1;
 
+		else if (strcmp(argv[0], "-F") == 0)
+			fast = 1;
+
 		else if (strcmp(argv[0], "-h") == 0)
 			usage(name, 0);
 
+		else if (strcmp(argv[0], "-H") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			hist = atoi(argv[1]);
+			argv++;
+			argc--;
+		}
+
 		else if (strcmp(argv[0], "-l") == 0) {
 			if (argc < 2)
 				usage(name, 1);
@@ -141,12 +214,72 @@ int main(int argc, char **argv)
 			argc--;
 		}
 
+		else if (strcmp(argv[0], "-L") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			lazy = atoi(argv[1]);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-i") == 0)
+			prescan = 1;
+
+		else if (strcmp(argv[0], "-I") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			segsize = atoi(argv[1]);
+			if (segsize <= 0)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-n") == 0)
+			prescan = 0;
+
+		else if (strcmp(argv[0], "-o") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			osize = atoi(argv[1]);
+			if (osize < slz_bound(1))
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-p") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			threads = atoi(argv[1]);
+			if (threads <= 0)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-s") == 0) {
+			if (argc < 2)
+				usage(name, 1);
+			blk = atoi(argv[1]);
+			if (blk <= 0)
+				usage(name, 1);
+			argv++;
+			argc--;
+		}
+
+		else if (strcmp(argv[0], "-S") == 0)
+			sync = 1;
+
 		else if (strcmp(argv[0], "-t") == 0)
 			test = 1;
 
 		else if (strcmp(argv[0], "-v") == 0)
 			verbose++;
 
+		else if (strcmp(argv[0], "-W") == 0)
+			workspace = (void *)1; // allocated later
+
 		else if (strcmp(argv[0], "-D") == 0)
 			format = SLZ_FMT_DEFLATE;
 
@@ -176,6 +309,8 @@ int main(int argc, char **argv)
 
 	slz_make_crc_table();
 	slz_prepare_dist_table();
+	if (cpu >= 0)
+		slz_set_cpu(cpu);
 
 	buflen = bufsize;
 	if (bufsize <= 0) {
@@ -192,12 +327,29 @@ int main(int argc, char **argv)
 		bufsize = (bufsize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 	}
 
-	outbuf = calloc(1, BLK + 4096);
+	if (!blk)
+		blk = threads > 1 ? threads * MT_BLK : BLK;
+
+	/* each thread and the sync flush may add an empty stored block */
+	outbuf = calloc(1, slz_bound(blk) + 6 * threads + 6);
 	if (!outbuf) {
 		perror("calloc");
 		exit(1);
 	}
 
+	if (segsize) {
+		iov = calloc((blk + segsize - 1) / segsize, sizeof(*iov));
+		if (!iov) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+
+	if (workspace && posix_memalign(&workspace, 64, slz_workspace_size(level, hbits)) != 0) {
+		perror("posix_memalign");
+		exit(1);
+	}
+
 	buffer = mmap(NULL, bufsize, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (buffer == MAP_FAILED) {
 		buffer = calloc(1, bufsize);
@@ -214,14 +366,54 @@ int main(int argc, char **argv)
 	}
 
 	while (loops--) {
-		slz_init(&strm, level, format);
+		slz_init_ex(&strm, level, format, hbits);
+		slz_set_lazy(&strm, lazy);
+		slz_set_prescan(&strm, prescan);
+		slz_set_fast(&strm, fast);
 
 		len = ofs = 0;
 		do {
-			len += slz_encode(&strm, outbuf + len, buffer + ofs, (buflen - ofs) > BLK ? BLK : buflen - ofs, (buflen - ofs) > BLK);
-			if (buflen - ofs > BLK) {
+			hlen = ofs < hist ? ofs : hist;
+			if (threads > 1)
+				len += slz_encode_mt(&strm, outbuf + len, buffer + ofs, (buflen - ofs) > blk ? blk : buflen - ofs, (buflen - ofs) > blk, threads);
+			else if (osize) {
+				long used, done = 0;
+				int ilen = (buflen - ofs) > blk ? blk : buflen - ofs;
+
+				/* send full buffers until the chunk is consumed */
+				while (1) {
+					hlen = ofs + done < hist ? ofs + done : hist;
+					len += slz_encode_partial(&strm, outbuf + len, osize - len, buffer + ofs + done, ilen - done,
+					                          (buflen - ofs) > blk, buffer + ofs + done - hlen, hlen, &used);
+					done += used;
+					if (done == ilen)
+						break;
+					totout += len;
+					obufs++;
+					if (console && !test)
+						write(1, outbuf, len);
+					len = 0;
+				}
+			}
+			else if (segsize) {
+				int ilen = (buflen - ofs) > blk ? blk : buflen - ofs;
+
+				for (iovcnt = 0; iovcnt * segsize < ilen; iovcnt++) {
+					iov[iovcnt].iov_base = buffer + ofs + iovcnt * segsize;
+					iov[iovcnt].iov_len = ilen - iovcnt * segsize > segsize ? segsize : ilen - iovcnt * segsize;
+				}
+				len += slz_encodev(&strm, outbuf + len, iov, iovcnt, (buflen - ofs) > blk);
+			}
+			else if (workspace)
+				len += slz_encode_ws(&strm, outbuf + len, buffer + ofs, (buflen - ofs) > blk ? blk : buflen - ofs, (buflen - ofs) > blk, buffer + ofs - hlen, hlen, workspace);
+			else
+				len += slz_encode_hist(&strm, outbuf + len, buffer + ofs, (buflen - ofs) > blk ? blk : buflen - ofs, (buflen - ofs) > blk, buffer + ofs - hlen, hlen);
+			stored += strm.incomp;
+			if (buflen - ofs > blk) {
+				if (sync)
+					len += slz_flush(&strm, outbuf + len);
 				totout += len;
-				ofs += BLK;
+				ofs += blk;
 				if (console && !test)
 					write(1, outbuf, len);
 				len = 0;
@@ -236,7 +428,13 @@ int main(int argc, char **argv)
 			write(1, outbuf, len);
 	}
 	if (verbose)
-		fprintf(stderr, "totin=%d totout=%d ratio=%.2f%% crc32=%08x\n", totin, totout, totout * 100.0 / totin, strm.crc32);
+		fprintf(stderr, "totin=%d totout=%d ratio=%.2f%% crc32=%08x stored=%d cpu=%s obufs=%d\n", totin, totout, totout * 100.0 / totin, strm.crc32, stored, slz_cpu_name(slz_get_cpu()), obufs);
+	if (verbose > 1 && slz_get_stats(&stats, 0) == 0)
+		fprintf(stderr, "matches=%llu match_len=%llu lit_bytes=%llu stored_bytes=%llu huff_bytes=%llu block_switches=%llu rejected_hits=%llu\n",
+		        (unsigned long long)stats.matches, (unsigned long long)stats.match_len,
+		        (unsigned long long)stats.lit_bytes, (unsigned long long)stats.stored_bytes,
+		        (unsigned long long)stats.huff_bytes, (unsigned long long)stats.block_switches,
+		        (unsigned long long)stats.rejected_hits);
 
 	return 0;
 }
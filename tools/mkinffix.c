@@ -0,0 +1,96 @@
+/* builds the decoding tables of fixed huffman blocks used by inflate.c. Each
+ * 9-bit (5-bit for distances) bit-reversed input directly indexes the entry
+ * of the symbol it starts with, made of the value in bits 16-31, the type in
+ * bits 12-15 (0=literal, 1=length or distance, 2=end of block, 4=invalid),
+ * the number of extra bits in bits 8-11 and the code length in bits 0-7.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+static const uint16_t len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13,
+	15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+	67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+	1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+	4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25,
+	33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+	1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3,
+	4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+	9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+#define ENTRY(type, val, extra, bits) (((uint32_t)(val) << 16) | ((type) << 12) | ((extra) << 8) | (bits))
+
+/* returns the <bits> lower bits of <code> in reverse order */
+static uint32_t rev(uint32_t code, int bits)
+{
+	uint32_t r = 0;
+
+	while (bits--) {
+		r = (r << 1) | (code & 1);
+		code >>= 1;
+	}
+	return r;
+}
+
+/* returns the entry of literal/length symbol <sym>, whose code is <bits> long */
+static uint32_t lit_entry(int sym, int bits)
+{
+	if (sym < 256)
+		return ENTRY(0, sym, 0, bits);
+	if (sym == 256)
+		return ENTRY(2, 0, 0, bits);
+	if (sym < 286)
+		return ENTRY(1, len_base[sym - 257], len_extra[sym - 257], bits);
+	return ENTRY(4, 0, 0, bits);
+}
+
+/* stores the entry <e> of a code <code> of <bits> bits into the table */
+static void store(uint32_t *table, int root, uint32_t code, int bits, uint32_t e)
+{
+	int i;
+
+	for (i = rev(code, bits); i < 1 << root; i += 1 << bits)
+		table[i] = e;
+}
+
+void main()
+{
+	uint32_t lit[512], dist[32];
+	int sym, i;
+
+	/* RFC1951 #3.2.6 */
+	for (sym = 0; sym < 144; sym++)
+		store(lit, 9, 0x30 + sym, 8, lit_entry(sym, 8));
+	for (sym = 144; sym < 256; sym++)
+		store(lit, 9, 0x190 + sym - 144, 9, lit_entry(sym, 9));
+	for (sym = 256; sym < 280; sym++)
+		store(lit, 9, sym - 256, 7, lit_entry(sym, 7));
+	for (sym = 280; sym < 288; sym++)
+		store(lit, 9, 0xc0 + sym - 280, 8, lit_entry(sym, 8));
+
+	for (sym = 0; sym < 32; sym++)
+		store(dist, 5, sym, 5, sym < 30 ? ENTRY(1, dist_base[sym], dist_extra[sym], 5) : ENTRY(4, 0, 0, 5));
+
+	printf("static const uint32_t fixed_lit[512] = {\n");
+	for (i = 0; i < 512; i++)
+		printf("%s0x%08x,%s", (i & 7) ? " " : "\t", lit[i], (i & 7) == 7 ? "\n" : "");
+	printf("};\n\nstatic const uint32_t fixed_dist[32] = {\n");
+	for (i = 0; i < 32; i++)
+		printf("%s0x%08x,%s", (i & 7) ? " " : "\t", dist[i], (i & 7) == 7 ? "\n" : "");
+	printf("};\n");
+	exit(0);
+}